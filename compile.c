@@ -0,0 +1,657 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sres.h"
+
+/* A compiled schedule (see sched_save) is a struct sresc_header, then the
+ * entries, then their year spans, then their descriptions. Everything is
+ * referred to by offset, so the file can be mapped anywhere.
+ *
+ * An occurrence index (see sched_index) is a struct sresx_header, then a
+ * stamp of each input it was made from, then a struct sresx_entry for each
+ * entry, then their descriptions, then (aligned) a struct sresx_rec for each
+ * occurrence, in the order cursor_next gives them. */
+
+/* Offsets of the parts of a compiled schedule with the given sizes. */
+static void
+sresc_layout(struct sresc_header *h)
+{
+	h->entryoff = sizeof *h;
+	h->spanoff = h->entryoff + h->nentries * sizeof(struct sresc_entry);
+	h->textoff = h->spanoff + h->nspans * sizeof(struct span);
+}
+
+/* Likewise for an occurrence index. */
+static void
+sresx_layout(struct sresx_header *h)
+{
+	h->inputoff = sizeof *h;
+	h->entryoff = h->inputoff + h->ninputs * sizeof(struct inputstamp);
+	h->textoff = h->entryoff + h->nentries * sizeof(struct sresx_entry);
+	h->recoff = (h->textoff + h->textlen + 7) / 8 * 8;
+}
+
+bool
+sresc_is(struct input *in)
+{
+	return in->len >= sizeof(SRESC_MAGIC)-1 &&
+	       !memcmp(in->buf, SRESC_MAGIC, sizeof(SRESC_MAGIC)-1);
+}
+
+static bool
+sched_write(FILE *f, struct sched *s)
+{
+	struct sresc_header h;
+	struct sresc_entry ce;
+	struct entry *e, *d;
+	uint64_t *textoffs;
+	size_t i;
+	bool ok;
+
+	/* Entries with the same dup share their description, so it is only
+	 * written for the first of them. */
+	if ((textoffs = malloc(max(s->nentries, 1) * sizeof *textoffs)) == NULL) {
+		errset("out of memory");
+		return false;
+	}
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, SRESC_MAGIC, sizeof h.magic);
+	h.version = SRESC_VERSION;
+	h.byteorder = SRESC_BYTEORDER;
+	h.nentries = s->nentries;
+	for (i = 0; i < s->nentries; ++i) {
+		e = &s->entries[i];
+		h.nspans += e->year.len;
+		if (e->dup == i) {
+			textoffs[i] = h.textlen;
+			h.textlen += e->textlen;
+		}
+	}
+	sresc_layout(&h);
+
+	ok = fwrite(&h, sizeof h, 1, f) == 1;
+	h.nspans = 0;
+	for (i = 0; i < s->nentries && ok; ++i) {
+		e = &s->entries[i];
+		d = &s->entries[e->dup];
+		memset(&ce, 0, sizeof ce);
+		ce.min = e->min;
+		ce.hour = e->hour;
+		ce.dow = e->dow;
+		ce.dom = e->dom;
+		ce.mon = e->mon;
+		ce.dur = e->dur;
+		ce.span = h.nspans;
+		ce.nspans = e->year.len;
+		ce.text = textoffs[e->dup];
+		ce.textlen = d->textlen;
+		h.nspans += e->year.len;
+		ok = fwrite(&ce, sizeof ce, 1, f) == 1;
+	}
+	for (i = 0; i < s->nentries && ok; ++i) {
+		e = &s->entries[i];
+		ok = fwrite(e->year.spans, sizeof *e->year.spans, e->year.len, f) ==
+		     e->year.len;
+	}
+	for (i = 0; i < s->nentries && ok; ++i) {
+		e = &s->entries[i];
+		if (e->dup == i && e->textlen > 0)
+			ok = fwrite(e->text, 1, e->textlen, f) == e->textlen;
+	}
+	if (!ok)
+		errset(strerror(errno));
+	free(textoffs);
+	return ok;
+}
+
+/* Write a file with write, replacing path atomically, so that a file which
+ * is rewritten while in use is never seen half written. */
+static bool
+save(char const *path, bool (*write)(FILE *f, void *arg), void *arg)
+{
+	char *tmp;
+	FILE *f;
+	bool ok;
+
+	if ((tmp = malloc(strlen(path) + sizeof ".tmp")) == NULL) {
+		errset("out of memory");
+		return false;
+	}
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+	if ((f = fopen(tmp, "wb")) == NULL) {
+		errset(strerror(errno));
+		ok = false;
+	} else {
+		ok = write(f, arg);
+		if (fclose(f) != 0 && ok) {
+			errset(strerror(errno));
+			ok = false;
+		}
+		if (ok && rename(tmp, path) != 0) {
+			errset(strerror(errno));
+			ok = false;
+		}
+		if (!ok)
+			remove(tmp);
+	}
+	free(tmp);
+	if (!ok)
+		erradd(path);
+	return ok;
+}
+
+static bool
+sresc_write(FILE *f, void *arg)
+{
+	return sched_write(f, arg);
+}
+
+/* Write s to path as a compiled schedule, which sched_load reads back much
+ * faster than text. */
+bool
+sched_save(struct sched *s, char const *path)
+{
+	return save(path, sresc_write, s);
+}
+
+/* Whether the masks and spans of e are ones that parse_entries could have
+ * produced, since the iterators rely on that. */
+static bool
+sresc_entry_valid(struct sresc_entry *ce, struct span *spans)
+{
+	uint64_t i;
+
+	if ((ce->min >> 60) || (ce->hour >> 24) || (ce->dow >> 7) ||
+	    (ce->dom >> 31) || (ce->mon >> 12) ||
+	    !ce->min || !ce->hour || !ce->dow || !ce->dom || !ce->mon)
+		return false;
+	if (ce->dur < 0 || ce->dur > LONG_MAX || ce->nspans == 0)
+		return false;
+	for (i = 0; i < ce->nspans; ++i) {
+		if (spans[i].begin > spans[i].end)
+			return false;
+		/* Sorted and merged, as spanarr_coalesce leaves them. */
+		if (i > 0 && (long long)spans[i].begin - spans[i-1].end <= 1)
+			return false;
+	}
+	return true;
+}
+
+/* Append the entries of the compiled schedule in to s. The descriptions and
+ * spans are used where they are in the input, not copied. */
+bool
+sresc_load(struct sched *s, struct input *in)
+{
+	struct sresc_header h;
+	struct sresc_entry *ces, *ce;
+	struct span *spans;
+	struct entry *entries, *e;
+	size_t from, i;
+
+	if (in->len < sizeof h) {
+		errset("compiled schedule: truncated");
+		goto err;
+	}
+	memcpy(&h, in->buf, sizeof h);
+	if (h.byteorder != SRESC_BYTEORDER) {
+		errset("compiled schedule: wrong byte order");
+		goto err;
+	}
+	if (h.version != SRESC_VERSION) {
+		errset("compiled schedule: unsupported version");
+		goto err;
+	}
+	if (h.nentries > (SIZE_MAX - s->nentries) / sizeof *entries) {
+		errset("too many entries");
+		goto err;
+	}
+	/* Both the header's offsets and the sizes must agree with the length of
+	 * the input. */
+	if (h.nentries > (in->len - sizeof h) / sizeof *ces ||
+	    h.entryoff != sizeof h ||
+	    h.spanoff != h.entryoff + h.nentries * sizeof *ces ||
+	    h.spanoff > in->len ||
+	    h.nspans > (in->len - h.spanoff) / sizeof *spans ||
+	    h.textoff != h.spanoff + h.nspans * sizeof *spans ||
+	    h.textlen != in->len - h.textoff) {
+		errset("compiled schedule: truncated or corrupt");
+		goto err;
+	}
+	ces = (struct sresc_entry *)(in->buf + h.entryoff);
+	spans = (struct span *)(in->buf + h.spanoff);
+
+	from = s->nentries;
+	if (from + h.nentries > s->cap) {
+		entries = realloc(s->entries, (from + h.nentries) * sizeof *entries);
+		if (entries == NULL) {
+			errset("out of memory");
+			goto err;
+		}
+		s->entries = entries;
+		s->cap = from + h.nentries;
+	}
+	for (i = 0; i < h.nentries; ++i) {
+		ce = &ces[i];
+		if (ce->span > h.nspans || ce->nspans > h.nspans - ce->span ||
+		    ce->text > h.textlen || ce->textlen > h.textlen - ce->text ||
+		    !sresc_entry_valid(ce, &spans[ce->span])) {
+			errset("compiled schedule: corrupt entry");
+			goto err;
+		}
+		e = &s->entries[from + i];
+		entry_init(e);
+		e->min = ce->min;
+		e->hour = ce->hour;
+		e->dow = ce->dow;
+		e->dom = ce->dom;
+		e->mon = ce->mon;
+		e->dur = ce->dur;
+		e->year.spans = &spans[ce->span];
+		e->year.len = e->year.cap = ce->nspans;
+		e->text = in->buf + h.textoff + ce->text;
+		e->textlen = ce->textlen;
+		e->id = e->dup = from + i;
+		if ((e->days = daytab_get(s, e->dow, e->dom, e->mon)) == NULL)
+			goto err;
+	}
+	s->nentries += h.nentries;
+	/* Also merges the entries with those of any other inputs. */
+	return sched_dedup(s, from);
+
+err:
+	if (in->name)
+		erradd(in->name);
+	return false;
+}
+
+static uint64_t
+fnv(uint64_t h, void const *p, size_t n)
+{
+	unsigned char const *c;
+
+	for (c = p; n > 0; --n)
+		h = (h ^ *c++) * UINT64_C(1099511628211);
+	return h;
+}
+
+static uint64_t
+fnvnum(uint64_t h, long long n)
+{
+	int64_t v;
+
+	v = n;
+	return fnv(h, &v, sizeof v);
+}
+
+/* A fingerprint of the entries an index was made from. */
+static uint64_t
+entries_hash(struct sched *s)
+{
+	struct entry *e;
+	uint64_t h;
+	size_t i, j;
+
+	h = fnvnum(UINT64_C(14695981039346656037), s->nentries);
+	for (i = 0; i < s->nentries; ++i) {
+		e = &s->entries[i];
+		h = fnvnum(h, e->min);
+		h = fnvnum(h, e->hour);
+		h = fnvnum(h, e->dow);
+		h = fnvnum(h, e->dom);
+		h = fnvnum(h, e->mon);
+		h = fnvnum(h, e->dur);
+		h = fnvnum(h, e->dup);
+		h = fnvnum(h, e->year.len);
+		for (j = 0; j < e->year.len; ++j) {
+			h = fnvnum(h, e->year.spans[j].begin);
+			h = fnvnum(h, e->year.spans[j].end);
+		}
+		h = fnvnum(h, e->textlen);
+		h = fnv(h, e->text, e->textlen);
+	}
+	return h;
+}
+
+/* Likewise of the time zone, which decides which times are skipped. */
+static uint64_t
+tz_hash(struct tz *tz)
+{
+	struct tzrule *r;
+	uint64_t h;
+	size_t i;
+	int k;
+
+	h = fnvnum(UINT64_C(14695981039346656037), tz->off0);
+	h = fnvnum(h, tz->ntrans);
+	for (i = 0; i < tz->ntrans; ++i) {
+		h = fnvnum(h, tz->trans[i].t);
+		h = fnvnum(h, tz->trans[i].off);
+	}
+	h = fnvnum(h, tz->hasrule);
+	if (tz->hasrule) {
+		h = fnvnum(h, tz->hasdst);
+		h = fnvnum(h, tz->stdoff);
+		h = fnvnum(h, tz->dstoff);
+		for (k = 0; k < 2; ++k) {
+			r = k == 0 ? &tz->start : &tz->end;
+			h = fnvnum(h, r->type);
+			h = fnvnum(h, r->n);
+			h = fnvnum(h, r->m);
+			h = fnvnum(h, r->w);
+			h = fnvnum(h, r->d);
+			h = fnvnum(h, r->secs);
+		}
+	}
+	return h;
+}
+
+struct indexjob {
+	struct sched *s;
+	struct tz *tz;
+	long long begint, endt;
+};
+
+static bool
+index_write(FILE *f, void *arg)
+{
+	static char const pad[8];
+	struct indexjob *j;
+	struct sresx_header h;
+	struct sresx_entry xe;
+	struct sresx_rec rec;
+	struct cursor c;
+	struct entryiter occ;
+	struct entry *e;
+	uint64_t *textoffs;
+	size_t i;
+	bool ok;
+
+	j = arg;
+	/* As in a compiled schedule, entries with the same dup share their
+	 * description. */
+	textoffs = malloc(max(j->s->nentries, 1) * sizeof *textoffs);
+	if (textoffs == NULL) {
+		errset("out of memory");
+		return false;
+	}
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, SRESX_MAGIC, sizeof h.magic);
+	h.version = SRESX_VERSION;
+	h.byteorder = SRESC_BYTEORDER;
+	h.begint = j->begint;
+	h.endt = j->endt;
+	h.hash = entries_hash(j->s);
+	h.tzhash = tz_hash(j->tz);
+	h.ninputs = j->s->ninputs;
+	h.nentries = j->s->nentries;
+	for (i = 0; i < j->s->nentries; ++i) {
+		e = &j->s->entries[i];
+		if (e->dup == i) {
+			textoffs[i] = h.textlen;
+			h.textlen += e->textlen;
+		}
+	}
+	sresx_layout(&h);
+
+	/* The count is filled in at the end. */
+	ok = fwrite(&h, sizeof h, 1, f) == 1;
+	for (i = 0; i < j->s->ninputs && ok; ++i)
+		ok = fwrite(&j->s->inputs[i].stamp, sizeof j->s->inputs[i].stamp, 1,
+		            f) == 1;
+	for (i = 0; i < j->s->nentries && ok; ++i) {
+		e = &j->s->entries[i];
+		memset(&xe, 0, sizeof xe);
+		xe.dur = e->dur;
+		xe.text = textoffs[e->dup];
+		xe.textlen = e->textlen;
+		ok = fwrite(&xe, sizeof xe, 1, f) == 1;
+	}
+	for (i = 0; i < j->s->nentries && ok; ++i) {
+		e = &j->s->entries[i];
+		if (e->dup == i && e->textlen > 0)
+			ok = fwrite(e->text, 1, e->textlen, f) == e->textlen;
+	}
+	if (ok && h.recoff > h.textoff + h.textlen)
+		ok = fwrite(pad, 1, h.recoff - h.textoff - h.textlen, f) ==
+		     h.recoff - h.textoff - h.textlen;
+	free(textoffs);
+	if (!ok) {
+		errset(strerror(errno));
+		return false;
+	}
+
+	if (!cursor_open(&c, j->s, j->tz, j->begint, j->endt))
+		return false;
+	memset(&rec, 0, sizeof rec);
+	while (ok && cursor_next(&c, &occ)) {
+		rec.begin = occ.t;
+		/* printf reports the overflow when the record is used. */
+		rec.end = occ.e->dur > LLONG_MAX - occ.t ? LLONG_MAX :
+		          occ.t + occ.e->dur;
+		rec.id = occ.e->id;
+		++h.nrecs;
+		ok = fwrite(&rec, sizeof rec, 1, f) == 1;
+	}
+	cursor_close(&c);
+	if (ok)
+		ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof h, 1, f) == 1;
+	if (!ok)
+		errset(strerror(errno));
+	return ok;
+}
+
+/* Write the occurrences of s between begint and endt, in the time zone tz,
+ * to path as an occurrence index. With index_open, any range of times within
+ * those can then be looked up without expanding the schedule again. */
+bool
+sched_index(struct sched *s, struct tz *tz, long long begint, long long endt,
+            char const *path)
+{
+	struct indexjob j;
+
+	j.s = s;
+	j.tz = tz;
+	j.begint = begint;
+	j.endt = endt;
+	return save(path, index_write, &j);
+}
+
+/* Map the index at path, and check that it is whole and was made in the time
+ * zone tz. */
+static bool
+index_map(struct index *ix, struct tz *tz, char const *path)
+{
+	struct sresx_header want;
+	size_t len;
+
+	ix->s = NULL;
+	ix->entries = NULL;
+	if (!input_open(&ix->in, path))
+		return false;
+	len = ix->in.len;
+	if (len < sizeof ix->h ||
+	    memcmp(ix->in.buf, SRESX_MAGIC, sizeof ix->h.magic)) {
+		errset("not an occurrence index");
+		goto err;
+	}
+	memcpy(&ix->h, ix->in.buf, sizeof ix->h);
+	if (ix->h.byteorder != SRESC_BYTEORDER) {
+		errset("occurrence index: wrong byte order");
+		goto err;
+	}
+	if (ix->h.version != SRESX_VERSION) {
+		errset("occurrence index: unsupported version");
+		goto err;
+	}
+	/* Both the header's offsets and the sizes must agree with the length of
+	 * the input. Bounding each size by it first keeps the sums in range. */
+	want = ix->h;
+	if (want.ninputs > len / sizeof(struct inputstamp) ||
+	    want.nentries > len / sizeof(struct sresx_entry) ||
+	    want.textlen > len) {
+		errset("occurrence index: truncated or corrupt");
+		goto err;
+	}
+	sresx_layout(&want);
+	if (ix->h.inputoff != want.inputoff || ix->h.entryoff != want.entryoff ||
+	    ix->h.textoff != want.textoff || ix->h.recoff != want.recoff ||
+	    want.recoff > len ||
+	    ix->h.nrecs != (len - want.recoff) / sizeof *ix->recs ||
+	    (len - want.recoff) % sizeof *ix->recs != 0) {
+		errset("occurrence index: truncated or corrupt");
+		goto err;
+	}
+	if (ix->h.tzhash != tz_hash(tz)) {
+		errset("occurrence index: made in another time zone");
+		goto err;
+	}
+	/* The records are only checked as they are used, so that opening the
+	 * index costs nothing per record. */
+	ix->recs = (struct sresx_rec const *)(ix->in.buf + ix->h.recoff);
+	return true;
+
+err:
+	erradd(path);
+	input_close(&ix->in);
+	return false;
+}
+
+/* Open the index at path, which must have been made from the same entries
+ * and time zone as s and tz. This costs as much as hashing s. */
+bool
+index_open(struct index *ix, struct sched *s, struct tz *tz, char const *path)
+{
+	if (!index_map(ix, tz, path))
+		return false;
+	if (ix->h.nentries != s->nentries || ix->h.hash != entries_hash(s)) {
+		errset("occurrence index: made from other events");
+		erradd(path);
+		input_close(&ix->in);
+		return false;
+	}
+	ix->s = s;
+	return true;
+}
+
+/* Open the index at path without a schedule, using the entries kept in it.
+ * The inputs (paths as for sched_load) must be the files it was made from,
+ * unchanged since as far as their inode, size, and modification time tell:
+ * they are only stat'ed, not read. Standard input can't be told apart that
+ * way, so it always fails for that; index_open is the fallback. */
+bool
+index_openinputs(struct index *ix, struct tz *tz, char const *path,
+                 char **inputs, size_t ninputs)
+{
+	struct inputstamp const *stamps;
+	struct inputstamp st;
+	size_t i;
+
+	if (!index_map(ix, tz, path))
+		return false;
+	stamps = (struct inputstamp const *)(ix->in.buf + ix->h.inputoff);
+	if (ix->h.ninputs != ninputs) {
+		errset("occurrence index: made from other inputs");
+		goto err;
+	}
+	for (i = 0; i < ninputs; ++i) {
+		if (!input_stamp(&st, inputs[i]))
+			goto err;
+		if (!st.valid || !stamps[i].valid) {
+			errset("occurrence index: input is not a regular file");
+			goto err;
+		}
+		if (memcmp(&st, &stamps[i], sizeof st)) {
+			errset("occurrence index: input changed since it was made");
+			goto err;
+		}
+	}
+	/* Filled in as they are used (see index_entry). */
+	ix->entries = calloc(max(ix->h.nentries, 1), sizeof *ix->entries);
+	if (ix->entries == NULL) {
+		errset("out of memory");
+		goto err;
+	}
+	return true;
+
+err:
+	erradd(path);
+	input_close(&ix->in);
+	return false;
+}
+
+void
+index_close(struct index *ix)
+{
+	free(ix->entries);
+	input_close(&ix->in);
+}
+
+/* The first record at or after t. */
+size_t
+index_seek(struct index *ix, long long t)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = ix->h.nrecs;
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (ix->recs[mid].begin < t)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The index's own copy of entry id, with just enough of it to print its
+ * occurrences. */
+static struct entry *
+index_entry(struct index *ix, size_t id)
+{
+	struct sresx_entry const *xe;
+	struct entry *e;
+
+	e = &ix->entries[id];
+	if (e->text != NULL)
+		return e;
+	xe = (struct sresx_entry const *)(ix->in.buf + ix->h.entryoff) + id;
+	if (xe->dur < 0 || xe->dur > LONG_MAX || xe->text > ix->h.textlen ||
+	    xe->textlen > ix->h.textlen - xe->text) {
+		errset("occurrence index: corrupt entry");
+		return NULL;
+	}
+	entry_init(e);
+	e->text = ix->in.buf + ix->h.textoff + xe->text;
+	e->textlen = xe->textlen;
+	e->dur = xe->dur;
+	e->id = e->dup = id;
+	return e;
+}
+
+/* Fill in *occ, as cursor_next would, from record i. */
+bool
+index_get(struct index *ix, size_t i, struct entryiter *occ)
+{
+	if (ix->recs[i].id >= ix->h.nentries) {
+		errset("occurrence index: corrupt record");
+		return false;
+	}
+	if (ix->s != NULL)
+		occ->e = &ix->s->entries[ix->recs[i].id];
+	else if ((occ->e = index_entry(ix, ix->recs[i].id)) == NULL)
+		return false;
+	occ->t = ix->recs[i].begin;
+	if (!min2dtime(&occ->dt, occ->t))
+		return false;
+	/* min2dtime does not set dow. */
+	return dtime_calcdow(&occ->dt);
+}
@@ -1,3 +1,7 @@
 #define DFLT_BEGIN "/"
 #define DFLT_END "/+1d"
 #define DFLT_FMT "%bH:%bm %bsd %bD %bsM %by %dm: %x"
+#define DFLT_RUNFMT "%bH:%bm %bsd %bD %bsM %by - %lH:%lm %lsd %lD %lsM %ly (%c) %dm: %x"
+#define DFLT_ACTIVEFMT "%aH:%am %asd %aD %asM %ay: %bH:%bm %bsd %bD %bsM %by %dm: %x"
+#define DFLT_REVBEGIN "/-1d"
+#define DFLT_REVEND "/"
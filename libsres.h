@@ -0,0 +1,258 @@
+/* The interface of libsres: schedules, cursors over their occurrences, and
+ * the time conversions needed to use them. */
+/* Requires: limits.h, pthread.h, stdbool.h, stdint.h */
+
+#define SPANV_MAX INT_MAX
+#define SPANV_MIN INT_MIN
+#define YEAR_MAX SPANV_MAX
+#define YEAR_MIN SPANV_MIN
+
+/* A year's type is the day of week of its 1 January plus 7 if it is a leap
+ * year; every year in the Gregorian calendar is one of these 14. */
+#define NYEARTYPES 14
+#define DAYBITS 366
+#define DAYWORDS ((DAYBITS + 63) / 64)
+/* The Gregorian calendar repeats every 400 years. */
+#define CYCLEYEARS 400
+#define CYCLEWORDS ((CYCLEYEARS + 63) / 64)
+#define DAYTAB_NBUCKETS 1024
+
+/* 1 Jan 1970 in minutes since 1 Jan 1BC (see dtime2min). */
+#define UNIX_EPOCH_MIN 1036120320LL
+
+enum dow {
+	SUN, MON, TUE, WED, THU, FRI, SAT
+};
+
+enum month {
+	JAN, FEB, MAR, APR, MAY, JUN,
+	JUL, AUG, SEP, OCT, NOV, DEC
+};
+
+/* Spanv is the type used to represent minutes, hours, dow, dom, months,
+ * and years. Using a bigger type will allow representing a wider range
+ * of years. Keep in sync with SPANV_MAX and SPANV_MIN. */
+/* TODO rename this */
+typedef int Spanv;
+
+/* Basically struct tm. */
+struct dtime {
+	Spanv min;  /* 0-59 */
+	Spanv hour; /* 0-23 */
+	Spanv dow;  /* 0-6, <0 => unknown */
+	Spanv dom;  /* 0-30 */
+	Spanv mon;  /* 0-11 */
+	Spanv year; /* ..., -1 == 2BC, 0 == 1BC, 1 == 1AD, 2 == 2AD, ... */
+};
+
+struct span {
+	Spanv begin;
+	Spanv end;
+};
+
+struct spanarr {
+	struct span *spans;
+	size_t len;
+	size_t cap;
+};
+
+/* For each year type, the days of the year (bit i => 0-based day i) allowed
+ * by a combination of dow, dom, and mon constraints. */
+struct daytab {
+	uint32_t dow, dom, mon;
+	uint64_t days[NYEARTYPES][DAYWORDS];
+	/* Bit i => some day is allowed in the years y with y mod 400 == i. */
+	uint64_t years[CYCLEWORDS];
+	struct daytab *next; /* Hash chain; see daytab_get. */
+};
+
+/* Every constraint except the year is a small, bounded set of values, so it is
+ * stored as a bitmask: bit i is set iff value i is permitted. */
+struct entry {
+	char const *text; /* Not terminated; points into the input. */
+	size_t textlen;
+	uint64_t min;
+	uint32_t hour, dow, dom, mon;
+	struct spanarr year; /* Spans are in the schedule's arena. */
+	struct daytab *days; /* Derived from dow, dom, and mon. */
+	long dur;
+	size_t id;  /* Index in the schedule's table; breaks ties in the merge. */
+	size_t dup; /* Id of the first entry with the same text and dur. */
+};
+
+struct entryiter {
+	struct entry *e;
+	long long t; /* dt in minutes since 1 Jan 1BC (see dtime2min). */
+	long long dayt; /* Ditto for 00:00 of dt's day. */
+	long long yeart; /* Ditto for 00:00 1 Jan of dt's year. */
+	struct dtime dt;
+	int doy; /* dt as a 0-based day of the year. */
+	size_t yeari;
+};
+
+/* Memory which is handed out in pieces and freed all at once. */
+struct arenablock {
+	struct arenablock *next;
+	long long data[]; /* Aligned for anything the schedule stores. */
+};
+
+struct arena {
+	struct arenablock *blocks;
+	char *p, *end; /* Free space in the first block. */
+};
+
+/* The merge's key for the iterator eis[i] of a cursor. Kept apart from the
+ * iterators so that the heap is small and cheap to reorder. */
+struct heapkey {
+	long long t;
+	size_t i;
+};
+
+/* Which version of a file was read: if any of these differ, it has changed
+ * since (see index_openinputs). */
+struct inputstamp {
+	uint64_t dev, ino;
+	int64_t size, mtime, mtimensec;
+	uint64_t valid; /* 0 => not a regular file, e.g. standard input. */
+};
+
+/* The contents of an input file, either mapped or read into memory. */
+struct input {
+	char const *name; /* NULL for standard input. */
+	char const *buf;
+	size_t len;
+	bool mapped;
+	struct inputstamp stamp;
+};
+
+/* A rule for the start or end of DST in a POSIX TZ string. */
+struct tzrule {
+	char type;   /* 'J' (Jn), 'D' (n), or 'M' (Mm.w.d). */
+	int n;       /* For 'J' and 'D'. */
+	int m, w, d; /* For 'M'. */
+	long secs;   /* Local time of day of the change. */
+};
+
+/* From Unix time t on, the UTC offset is off seconds. */
+struct tztrans {
+	long long t;
+	long off;
+};
+
+struct tz {
+	long off0; /* Offset before the first transition. */
+	struct tztrans *trans;
+	size_t ntrans;
+	/* POSIX TZ rule for times after the last transition. */
+	bool hasrule;
+	bool hasdst;
+	long stdoff, dstoff;
+	struct tzrule start, end;
+	/* The rule's transitions precomputed over the years of interest. */
+	struct tztrans *cache;
+	size_t ncache;
+	long cacheoff0;
+};
+
+/* The layout of an occurrence index. Offsets are in bytes from the start of
+ * the file. The records are sorted by begin, which is a time in minutes like
+ * entryiter's t, as is end. */
+struct sresx_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t nrecs;
+	int64_t begint, endt; /* The times covered. */
+	uint64_t hash;   /* Of the entries it was made from. */
+	uint64_t tzhash; /* Of the time zone it was made in. */
+	uint64_t ninputs, nentries, textlen;
+	uint64_t inputoff, entryoff, textoff, recoff;
+};
+
+struct sresx_rec {
+	int64_t begin, end;
+	uint64_t id;
+};
+
+/* A schedule: the entries of one or more inputs (see sched_load). Apart
+ * from parsing into it, which must not happen concurrently, a schedule is
+ * only ever read, so any number of cursors can use it at once. */
+struct sched {
+	struct entry *entries; /* In input order, indexed by id. */
+	size_t nentries, cap;
+	struct arena arena; /* For the entries' year spans. */
+	/* Hash table of the ids of the entries which are their own dup (SIZE_MAX
+	 * => empty); see sched_dedup. */
+	size_t *dups;
+	size_t ndups, dupcap;
+	struct input *inputs;
+	size_t ninputs;
+	struct daytab *daytabs[DAYTAB_NBUCKETS]; /* See daytab_get. */
+	pthread_mutex_t lock; /* For daytabs. */
+	void (*warn)(char const *msg); /* NULL => warnings are ignored. */
+};
+
+/* Occurrences of a schedule's events between two times, in order (see
+ * cursor_next). */
+struct cursor {
+	struct tz *tz;
+	struct entryiter *eis; /* In input order. */
+	struct heapkey *heap;  /* Of the n unexhausted iterators. */
+	size_t n;
+	long long *last; /* Last time reported per dup (by id). */
+	long long begint, endt;
+	bool rev; /* See cursor_openrev. */
+};
+
+/* An occurrence index, opened over the schedule it was made from, or over
+ * its own copy of the entries' descriptions and durations. */
+struct index {
+	struct sched *s;       /* NULL => the index's own entries. */
+	struct entry *entries; /* Those of them used so far, by id. */
+	struct input in;
+	struct sresx_header h;
+	struct sresx_rec const *recs;
+};
+
+/* sched.c */
+bool sched_init(struct sched *s);
+bool sched_load(struct sched *s, char const *path, int nthreads);
+void sched_free(struct sched *s);
+bool cursor_open(struct cursor *c, struct sched *s, struct tz *tz,
+                 long long begint, long long endt);
+bool cursor_openpart(struct cursor *c, struct sched *s, struct tz *tz,
+                     long long begint, long long endt,
+                     size_t part, size_t nparts);
+bool cursor_openrev(struct cursor *c, struct sched *s, struct tz *tz,
+                    long long begint, long long endt);
+bool cursor_next(struct cursor *c, struct entryiter *occ);
+bool cursor_nextrun(struct cursor *c, struct entryiter *occ, long long *n);
+void cursor_close(struct cursor *c);
+
+/* parse.c */
+bool parse_instant(struct dtime *dt, char *s);
+
+/* compile.c */
+bool sched_save(struct sched *s, char const *path);
+bool sched_index(struct sched *s, struct tz *tz, long long begint,
+                 long long endt, char const *path);
+bool index_open(struct index *ix, struct sched *s, struct tz *tz,
+                char const *path);
+bool index_openinputs(struct index *ix, struct tz *tz, char const *path,
+                      char **inputs, size_t ninputs);
+void index_close(struct index *ix);
+size_t index_seek(struct index *ix, long long t);
+bool index_get(struct index *ix, size_t i, struct entryiter *occ);
+
+/* time.c */
+bool dtime_calcdow(struct dtime *dt);
+bool dtime2min(long long *min, struct dtime *dt);
+bool min2dtime(struct dtime *dt, long long min);
+
+/* tz.c */
+bool tz_load(struct tz *tz, Spanv fromyear, Spanv toyear);
+void tz_free(struct tz *tz);
+long long tz_unix(struct tz *tz, long long min);
+
+/* util.c */
+char *errget(void);
@@ -1,11 +1,15 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "sres.h"
 
@@ -77,15 +81,126 @@ static char *months[] = {
 	"December",
 };
 
+/* Occurrences are rendered into outbuf, which is written out with a single
+ * write(2) whenever it fills up. A thread can instead capture what it renders
+ * into a buffer of its own, to be written out later with out_emit. */
+static char outbuf[OUTBUF_LEN];
+static size_t outlen;
+static _Thread_local struct strbuf *capture;
+
+static bool
+writeall(char const *s, size_t n)
+{
+	ssize_t w;
+
+	for (; n > 0; s += w, n -= w) {
+		if ((w = write(STDOUT_FILENO, s, n)) < 0) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			errset("failed to write output");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+out_flush(void)
+{
+	size_t n;
+
+	n = outlen;
+	outlen = 0;
+	return writeall(outbuf, n);
+}
+
+static void
+out_write(char const *s, size_t n)
+{
+	if (capture) {
+		if (n > capture->cap - capture->len) {
+			if (n > SIZE_MAX/2 - capture->len)
+				errexit("out of memory");
+			capture->cap = max(2*capture->cap, capture->len + n);
+			capture->buf = realloc_or_exit(capture->buf, capture->cap);
+		}
+		memcpy(capture->buf + capture->len, s, n);
+		capture->len += n;
+		return;
+	}
+	if (n > OUTBUF_LEN - outlen) {
+		if (!out_flush())
+			errexit(errget());
+		if (n > OUTBUF_LEN) {
+			if (!writeall(s, n))
+				errexit(errget());
+			return;
+		}
+	}
+	memcpy(outbuf + outlen, s, n);
+	outlen += n;
+}
+
+/* Render into sb (or into outbuf again if sb is NULL) on this thread. */
+void
+out_capture(struct strbuf *sb)
+{
+	capture = sb;
+}
+
+void
+out_emit(struct strbuf *sb)
+{
+	out_write(sb->buf, sb->len);
+}
+
+static void
+out_str(char const *s)
+{
+	out_write(s, strlen(s));
+}
+
+/* Like printf("%*lld") (pad == ' ') or printf("%0*lld") (pad == '0'). */
+static void
+out_num(long long val, int width, char pad)
+{
+	char buf[32];
+	char *p;
+	unsigned long long u;
+	int len;
+
+	p = buf + sizeof buf;
+	u = val < 0 ? -(unsigned long long) val : (unsigned long long) val;
+	do {
+		*--p = '0' + u%10;
+		u /= 10;
+	} while (u != 0);
+	len = buf + sizeof buf - p + (val < 0);
+	if (pad == '0') {
+		for (; len < width; ++len)
+			*--p = '0';
+		if (val < 0)
+			*--p = '-';
+	} else {
+		if (val < 0)
+			*--p = '-';
+		for (; len < width; ++len)
+			*--p = ' ';
+	}
+	out_write(p, buf + sizeof buf - p);
+}
+
 static void
 print2(Spanv val, unsigned int flags)
 {
 	if (flags & FLAG_s)
-		printf("%d", val);
+		out_num(val, 0, ' ');
 	else if (flags & FLAG_b)
-		printf("%2d", val);
+		out_num(val, 2, ' ');
 	else
-		printf("%02d", val);
+		out_num(val, 2, '0');
 }
 
 static bool
@@ -99,7 +214,7 @@ static bool
 print_h(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 {
 	if (dt->hour == 0 || dt->hour == 12)
-		printf("12");
+		out_str("12");
 	else
 		print2(dt->hour % 12, flags);
 	return true;
@@ -126,7 +241,7 @@ print_p(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 		buf[1] = buf[2];
 		buf[2] = '\0';
 	}
-	printf("%s", buf);
+	out_str(buf);
 	return true;
 };
 
@@ -135,9 +250,9 @@ print_d(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 {
 	char buf[16];
 	if (flags & FLAG_0) {
-		printf("%d", dt->dow);
+		out_num(dt->dow, 0, ' ');
 	} else if (flags & FLAG_1) {
-		printf("%d", dt->dow + 1);
+		out_num(dt->dow + 1, 0, ' ');
 	} else {
 		assert(0 <= dt->dow && dt->dow < 7);
 		strcpy(buf, daysofweek[dt->dow]);
@@ -145,7 +260,7 @@ print_d(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 			buf[0] = tolower(buf[0]);
 		if (flags & FLAG_s)
 			buf[3] = '\0';
-		printf("%s", buf);
+		out_str(buf);
 	}
 	return true;
 };
@@ -172,7 +287,7 @@ print_M(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 			buf[0] = tolower(buf[0]);
 		if (flags & FLAG_s)
 			buf[3] = '\0';
-		printf("%s", buf);
+		out_str(buf);
 	}
 	return true;
 };
@@ -181,9 +296,9 @@ static bool
 print_y(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 {
 	if (flags & FLAG_s && dt->year >= 0)
-		printf("%02d", dt->year % 100);
+		out_num(dt->year % 100, 2, '0');
 	else
-		printf("%d", dt->year);
+		out_num(dt->year, 0, ' ');
 	return true;
 };
 
@@ -200,9 +315,9 @@ print_Y(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 		year = -year + 1;
 	}
 	if (flags & FLAG_s)
-		printf("%02d", year % 100);
+		out_num(year % 100, 2, '0');
 	else
-		printf("%d", year);
+		out_num(year, 0, ' ');
 	return true;
 };
 
@@ -222,7 +337,7 @@ print_e(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 		buf[1] = buf[2];
 		buf[2] = '\0';
 	}
-	printf("%s", buf);
+	out_str(buf);
 	return true;
 };
 
@@ -233,97 +348,197 @@ print_u(struct dtime *dt, time_t u, bool uvalid, unsigned int flags)
 		errset("time could not be represented as Unix timestamp");
 		return false;
 	}
-	printf("%jd", (intmax_t) u);
+	out_num(u, 0, ' ');
 	return true;
 };
 
 bool
-entryiter_printf(char *fmt, struct entryiter *ei)
+fmt_compile(struct fmt *f, char *s)
 {
 	int i;
-	struct dtime begindt, enddt, *dt;
-	struct tm tm;
-	time_t beginu, endu, u;
-	bool uvalid;
 	unsigned int flags;
-	int f;
+	int fl;
+	struct fmtop op;
 
-	begindt = enddt = ei->dt;
-	assert(inrange(begindt.dow, 0, 7));
-	if (!dtime_add(&enddt, ei->e->dur))
-		return false;
-	/* dtime_add does not set dow. */
-	assert(dtime_calcdow(&enddt));
-
-	/* We rely on time.h for Unix time conversions (this should probably be
-	 * changed), but the times representable by time.h types are not
-	 * guaranteed to be as big as we allow with dtime. We calculate the Unix
-	 * time representations of the begin and end times in advance, but don't
-	 * want to fail with an error when the dtime cannot be represented as a
-	 * time_t unless the fmt actually has a %bu/%eu field in it. Hence, we
-	 * set uvalid and fail lazily. */
-	uvalid = dtime2tm(&tm, &begindt);
-	if (uvalid) {
-		beginu = mktime(&tm);
-		/* mktime modifies tm_isdst iff it succeeds. */
-		uvalid = tm.tm_isdst != -1;
-		if (uvalid) {
-			uvalid = dtime2tm(&tm, &enddt);
-			if (uvalid) {
-				endu = mktime(&tm);
-				uvalid = tm.tm_isdst != -1;
+	f->ops = NULL;
+	f->len = 0;
+	f->needend = false;
+	f->needlast = false;
+	f->needat = false;
+	f->needu = false;
+	for (i = 0; s[i] != '\0'; ++i) {
+		op.type = FMTOP_LIT;
+		op.lit = &s[i];
+		op.litlen = 1;
+		if (s[i] == '%') {
+			switch (s[++i]) {
+			case '%': op.lit = "%";  break;
+			case 't': op.lit = "\t"; break;
+			case 'n': op.lit = "\n"; break;
+			case 'x': op.type = FMTOP_TEXT; break;
+			case 'd': op.type = FMTOP_DUR;  break;
+			case 'c': op.type = FMTOP_COUNT; break;
+			case 'e':
+			case 'b':
+			case 'l':
+			case 'a':
+				op.type = s[i] == 'e' ? FMTOP_END :
+				          s[i] == 'l' ? FMTOP_LAST :
+				          s[i] == 'a' ? FMTOP_AT : FMTOP_BEGIN;
+				flags = 0;
+				++i;
+				while (inrange(s[i], 0, arrlen(flagmap)) &&
+				       (fl = flagmap[(int)s[i]]) != 0) {
+					if (flags&fl) {
+						errset("bad fmt: duplicate flag");
+						goto err;
+					}
+					flags |= fl;
+					++i;
+				}
+				if (!inrange(s[i], 0, arrlen(handlers)) ||
+				    handlers[(int)s[i]] == NULL) {
+					errset("bad fmt: invalid conversion specifier");
+					goto err;
+				}
+				op.flags = flags;
+				op.conv = s[i];
+				f->needend |= op.type == FMTOP_END;
+				f->needlast |= op.type == FMTOP_LAST;
+				f->needat |= op.type == FMTOP_AT;
+				f->needu |= op.conv == 'u';
+				break;
+			default: /* Includes s[i] == '\0'. */
+				errset("bad fmt: invalid conversion specifier");
+				goto err;
 			}
 		}
-	}
-
-	for (i = 0; fmt[i] != '\0'; ++i) {
-		if (fmt[i] != '%') {
-			printf("%c", fmt[i]);
+		/* Adjacent plain characters are copied out in one go. */
+		if (op.type == FMTOP_LIT && f->len > 0 &&
+		    f->ops[f->len-1].type == FMTOP_LIT &&
+		    f->ops[f->len-1].lit + f->ops[f->len-1].litlen == op.lit) {
+			++f->ops[f->len-1].litlen;
 			continue;
 		}
+		f->ops = realloc_or_exit(f->ops, (f->len+1) * sizeof *f->ops);
+		f->ops[f->len++] = op;
+	}
 
-		switch (fmt[++i]) {
-		case '%': printf("%%"); continue;
-		case 't': printf("\t"); continue;
-		case 'n': printf("\n"); continue;
-		case 'x': printf("%s", ei->e->text); continue;
-		case 'd': printf("%ld", ei->e->dur); continue;
-		case 'e':
-			u = endu;
-			dt = &enddt;
-			break;
-		case 'b':
-			u = beginu;
-			dt = &begindt;
-			break;
-		default: /* Includes fmt[i] == '\0'. */
-			errset("bad fmt: invalid conversion specifier");
-			return false;
-		}
+	op.type = FMTOP_LIT;
+	op.lit = "\n";
+	op.litlen = 1;
+	f->ops = realloc_or_exit(f->ops, (f->len+1) * sizeof *f->ops);
+	f->ops[f->len++] = op;
+	return true;
 
-		flags = 0;
+err:
+	free(f->ops);
+	f->ops = NULL;
+	return false;
+}
 
-		++i;
-		while (inrange(fmt[i], 0, arrlen(flagmap)) &&
-		       (f = flagmap[(int)fmt[i]]) != 0) {
-			if (flags&f) {
-				errset("bad fmt: duplicate flag");
-				return false;
-			}
-			flags |= f;
-			++i;
-		}
+/* Print the n occurrences of ei's entry at consecutive minutes from ei->t on
+ * (see cursor_nextrun); n is 1 for a lone occurrence. */
+bool
+entryiter_printf(struct fmt *f, struct tz *tz, struct entryiter *ei,
+                 long long n)
+{
+	return entryiter_printfat(f, tz, ei, n, ei->t);
+}
+
+/* Like entryiter_printf, for occurrences found for the time at (see -a). */
+bool
+entryiter_printfat(struct fmt *f, struct tz *tz, struct entryiter *ei,
+                   long long n, long long at)
+{
+	size_t i;
+	struct dtime begindt, enddt, lastdt, atdt;
+	long long lastt, endt, u;
+	time_t beginu, endu, lastu, atu;
+	bool uvalid;
+	struct fmtop *op;
 
-		if (!inrange(fmt[i], 0, arrlen(handlers)) ||
-		    handlers[(int)fmt[i]] == NULL) {
-			errset("bad fmt: invalid conversion specifier");
+	/* Only the output decomposes the iterator's minute count back into civil
+	 * fields; the begin fields are kept up to date by the iterator itself. */
+	begindt = ei->dt;
+	assert(inrange(begindt.dow, 0, 6));
+	lastt = ei->t + (n-1);
+	if (lastt > LLONG_MAX - ei->e->dur) {
+		errset("end time overflows");
+		return false;
+	}
+	/* The end is that of the last occurrence. */
+	endt = lastt + ei->e->dur;
+	if (f->needend) {
+		if (!min2dtime(&enddt, endt))
 			return false;
-		}
-		if (!handlers[(int)fmt[i]](dt, u, uvalid, flags))
+		/* min2dtime does not set dow. */
+		dtime_calcdow(&enddt);
+	}
+	lastdt = begindt;
+	if (f->needlast && n > 1) {
+		if (!min2dtime(&lastdt, lastt))
+			return false;
+		dtime_calcdow(&lastdt);
+	}
+	if (f->needat) {
+		if (!min2dtime(&atdt, at))
 			return false;
+		dtime_calcdow(&atdt);
+	}
+
+	/* The times representable by time_t are not guaranteed to be as big as
+	 * we allow with dtime. We calculate the Unix time representations of the
+	 * begin and end times in advance, but don't want to fail with an error
+	 * when the dtime cannot be represented as a time_t unless the fmt
+	 * actually has a %bu/%eu field in it. Hence, we set uvalid and fail
+	 * lazily. */
+	uvalid = false;
+	beginu = endu = lastu = atu = 0;
+	if (f->needu) {
+		beginu = u = tz_unix(tz, ei->t);
+		uvalid = beginu == u;
+		endu = u = tz_unix(tz, endt);
+		uvalid = uvalid && endu == u;
+		lastu = u = tz_unix(tz, lastt);
+		uvalid = uvalid && lastu == u;
+		atu = u = tz_unix(tz, at);
+		uvalid = uvalid && atu == u;
+	}
+
+	for (i = 0; i < f->len; ++i) {
+		op = &f->ops[i];
+		switch (op->type) {
+		case FMTOP_LIT:
+			out_write(op->lit, op->litlen);
+			break;
+		case FMTOP_TEXT:
+			out_write(ei->e->text, ei->e->textlen);
+			break;
+		case FMTOP_DUR:
+			out_num(ei->e->dur, 0, ' ');
+			break;
+		case FMTOP_BEGIN:
+			if (!handlers[(int)op->conv](&begindt, beginu, uvalid, op->flags))
+				return false;
+			break;
+		case FMTOP_END:
+			if (!handlers[(int)op->conv](&enddt, endu, uvalid, op->flags))
+				return false;
+			break;
+		case FMTOP_LAST:
+			if (!handlers[(int)op->conv](&lastdt, lastu, uvalid, op->flags))
+				return false;
+			break;
+		case FMTOP_AT:
+			if (!handlers[(int)op->conv](&atdt, atu, uvalid, op->flags))
+				return false;
+			break;
+		case FMTOP_COUNT:
+			out_num(n, 0, ' ');
+			break;
+		}
 	}
 
-	printf("\n");
-	
 	return true;
 }
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -210,16 +211,53 @@ parse_spanarr(struct spanarr *arr, char *s,
 		}
 		span.begin = min;
 		span.end = max;
-		if (!spanarr_insert(arr, span))
+		if (!spanarr_append(arr, span))
 			return false;
 	} else {
 		while (s) {
 			if (!parse_span(&span, nexttok(&s, ','), str2num))
 				return false;
-			if (!spanarr_insert(arr, span))
+			if (!spanarr_append(arr, span))
 				return false;
 		}
 	}
+	/* Sorting once at the end keeps long lists O(n log n). */
+	spanarr_coalesce(arr);
+
+	return true;
+}
+
+/* Bits span.begin through span.end (both in 0-63), inclusive. */
+static uint64_t
+spanbits(struct span span)
+{
+	return (UINT64_MAX >> (63 - span.end)) & (UINT64_MAX << span.begin);
+}
+
+bool
+parse_bitmask(uint64_t *mask, char *s,
+              bool (*str2num)(Spanv*, char**),
+              Spanv min, Spanv max)
+{
+	struct span span;
+
+	assert(0 <= min && max < 64);
+	*mask = 0;
+	if (strchr(s, '*')) {
+		if (strlen(s) > 1) {
+			errset("invalid use of wildcard");
+			return false;
+		}
+		span.begin = min;
+		span.end = max;
+		*mask = spanbits(span);
+	} else {
+		while (s) {
+			if (!parse_span(&span, nexttok(&s, ','), str2num))
+				return false;
+			*mask |= spanbits(span);
+		}
+	}
 
 	return true;
 }
@@ -283,105 +321,387 @@ parse_duration(long *dur, char **s)
 	return true;
 }
 
-/* Helper for parse_entries. */
-static bool
-parse_field(char **s, struct spanarr *arr, 
-            bool (*str2num)(Spanv*, char**),
-            Spanv min, Spanv max)
+/* Helpers for parse_entries, which works on slices of the input so that
+ * descriptions can point straight into it. A line's fields are copied into
+ * tok (one at a time) since the parse_XXX functions need them terminated. */
+struct line {
+	char const *s; /* NULL after the last field. */
+	char const *end;
+	char *tok;
+	size_t tokcap;
+};
+
+static char *
+nextfield(struct line *l)
 {
-	if (*s == NULL) {
+	char const *p;
+	char *tok;
+	size_t len;
+
+	if (l->s == NULL) {
 		errset("unexpected EOL");
-		return false;
+		return NULL;
 	}
-	skipws(s);
-	return parse_spanarr(arr, nexttok(s, ' '), str2num, min, max);
+	while (l->s < l->end && isspace(*l->s))
+		++l->s;
+	p = memchr(l->s, ' ', l->end - l->s);
+	len = (p ? p : l->end) - l->s;
+	if (len+1 > l->tokcap) {
+		if ((tok = realloc(l->tok, max(2*l->tokcap, len+1))) == NULL) {
+			errset("out of memory");
+			return NULL;
+		}
+		l->tok = tok;
+		l->tokcap = max(2*l->tokcap, len+1);
+	}
+	memcpy(l->tok, l->s, len);
+	l->tok[len] = '\0';
+	l->s = p ? p+1 : NULL;
+	return l->tok;
 }
 
-bool
-parse_entries(struct entry **entry, size_t *n)
+static bool
+parse_maskfield(struct line *l, uint64_t *mask,
+                bool (*str2num)(Spanv*, char**),
+                Spanv min, Spanv max)
 {
-	char *line;
-	char *s;
-	char buf[64];
-	size_t len;
-	long linecnt;
-	struct entry *prev;
+	char *tok;
+
+	return (tok = nextfield(l)) && parse_bitmask(mask, tok, str2num, min, max);
+}
+
+static bool
+parse_spanfield(struct line *l, struct spanarr *arr,
+                bool (*str2num)(Spanv*, char**),
+                Spanv min, Spanv max)
+{
+	char *tok;
 
-	line = NULL;
-	len = 0;
+	return (tok = nextfield(l)) && parse_spanarr(arr, tok, str2num, min, max);
+}
+
+/* A piece of an input, parsed on its own by parse_chunk. Line numbers and
+ * entry ids are relative to the chunk until parse_entries stitches the
+ * chunks back together. */
+struct chunk {
+	struct sched *sched;
+	char const *begin, *end;
+	struct entry *entries; /* Indexed by id. */
+	size_t n, cap;
+	struct arena arena; /* For the entries' year spans. */
+	long nlines;
+	/* Entries before the chunk's first description inherit the previous
+	 * chunk's. They come first; orphan is the line of the first of them (0 if
+	 * none). */
+	long orphan;
+	size_t norphans;
+	/* The chunk's last description. */
+	char const *text;
+	size_t textlen;
+	/* Lines of entries which never occur. */
+	long *warns;
+	size_t nwarns, warncap;
+	bool ok;
+	long errline;
+	char *err;
+};
+
+static void *
+parse_chunk(void *arg)
+{
+	struct chunk *c;
+	char const *p, *eol;
+	struct line l;
+	long linecnt;
+	uint64_t mask;
+	char *tok;
+	long *warns;
+	size_t warncap, cap;
+	struct entry *entries, *e;
+	struct spanarr year;
+
+	c = arg;
+	l.tok = NULL;
+	l.tokcap = 0;
 	linecnt = 0;
-	*entry = prev = NULL;
-	while (getline(&line, &len, stdin) != -1) {
+	/* Year spans are parsed into here, and only copied into the arena once
+	 * they are known to be kept. */
+	spanarr_init(&year);
+	for (p = c->begin; p < c->end; p = eol+1) {
+		if ((eol = memchr(p, '\n', c->end - p)) == NULL)
+			eol = c->end; /* No newline at the end of the input. */
 		/* Unlikely this could ever happen, but be safe. */
 		if (++linecnt == LONG_MAX) {
 			errset("too many lines");
 			goto err;
 		}
-		s = line;
-		stripws(&s);
+		l.s = p;
+		l.end = eol;
+		while (l.s < l.end && isspace(*l.s))
+			++l.s;
+		while (l.end > l.s && isspace(l.end[-1]))
+			--l.end;
 		/* Ignore line comments and whitespace-only/empty lines. */
-		if (*s == '#' || *s == '\0')
+		if (l.s == l.end || *l.s == '#')
 			continue;
-		*entry = malloc_or_exit(sizeof **entry);
-		entry_init(*entry);
-		if (++*n == SIZE_MAX) {
-			errset("too many entries");
-			goto err;
+		if (c->n == c->cap) {
+			if (c->cap > SIZE_MAX / 2 / sizeof *entries) {
+				errset("too many entries");
+				goto err;
+			}
+			cap = c->cap > 0 ? 2*c->cap : 64;
+			if ((entries = realloc(c->entries, cap * sizeof *entries)) == NULL) {
+				errset("out of memory");
+				goto err;
+			}
+			c->entries = entries;
+			c->cap = cap;
 		}
+		e = &c->entries[c->n];
+		entry_init(e);
 
 		/* Start time constraints */
-		if (!parse_field(&s, &(*entry)->min,  parse_min,  0,        59))
+		if (!parse_maskfield(&l, &mask, parse_min,  0, 59))
+			goto err;
+		e->min = mask;
+		if (!parse_maskfield(&l, &mask, parse_hour, 0, 23))
 			goto err;
-		if (!parse_field(&s, &(*entry)->hour, parse_hour, 0,        23))
+		e->hour = mask;
+		if (!parse_maskfield(&l, &mask, parse_dow,  0, 6))
 			goto err;
-		if (!parse_field(&s, &(*entry)->dow,  parse_dow,  0,        6))
+		e->dow = mask;
+		if (!parse_maskfield(&l, &mask, parse_dom,  0, 30))
 			goto err;
-		if (!parse_field(&s, &(*entry)->dom,  parse_dom,  0,        30))
+		e->dom = mask;
+		if (!parse_maskfield(&l, &mask, parse_mon,  0, 11))
 			goto err;
-		if (!parse_field(&s, &(*entry)->mon,  parse_mon,  0,        11))
+		e->mon = mask;
+		year.len = 0;
+		if (!parse_spanfield(&l, &year, parse_year, YEAR_MIN, YEAR_MAX))
 			goto err;
-		if (!parse_field(&s, &(*entry)->year, parse_year, YEAR_MIN, YEAR_MAX))
+		e->year = year;
+		if ((e->days = daytab_get(c->sched, e->dow, e->dom, e->mon)) == NULL)
 			goto err;
 
 		/* Duration */
-		if (s == NULL) {
-			errset("unexpected EOL");
-			goto err;
-		}
-		skipws(&s);
-		if (!parse_duration(&(*entry)->dur, &(char*){nexttok(&s, ' ')}))
+		if ((tok = nextfield(&l)) == NULL || !parse_duration(&e->dur, &tok))
 			goto err;
-		if ((*entry)->dur < 0) {
+		if (e->dur < 0) {
 			errset("invalid duration: must be nonnegative");
 			goto err;
 		}
 
-		/* Description */
-		if (s != NULL)
-			skipws(&s);
-		if (s == NULL || *s == '\0') {
-			if (prev == NULL) {
-				errset("first entry must have description");
-				goto err;
+		/* Description (not copied; it points into the input) */
+		if (l.s != NULL) {
+			while (l.s < l.end && isspace(*l.s))
+				++l.s;
+		}
+		if (l.s == NULL || l.s == l.end) {
+			if (c->text == NULL && c->orphan == 0)
+				c->orphan = linecnt; /* Resolved by parse_entries. */
+		} else {
+			c->text = l.s;
+			c->textlen = l.end - l.s;
+		}
+		e->text = c->text;
+		e->textlen = c->textlen;
+
+		if (!entry_occurs(e)) {
+			/* The description is kept, since the next entry may inherit it. */
+			if (c->nwarns == c->warncap) {
+				warncap = c->warncap > 0 ? 2*c->warncap : 16;
+				if ((warns = realloc(c->warns, warncap * sizeof *warns)) == NULL) {
+					errset("out of memory");
+					goto err;
+				}
+				c->warns = warns;
+				c->warncap = warncap;
 			}
-			(*entry)->text = prev->text;
+			c->warns[c->nwarns++] = linecnt;
+			continue;
+		}
+		e->year.spans = arena_alloc(&c->arena, year.len * sizeof *year.spans);
+		if (e->year.spans == NULL)
+			goto err;
+		memcpy(e->year.spans, year.spans, year.len * sizeof *year.spans);
+		e->year.cap = year.len;
+		++c->n;
+		if (c->text == NULL)
+			++c->norphans;
+	}
+
+	c->nlines = linecnt;
+	c->ok = true;
+	free(year.spans);
+	free(l.tok);
+	return NULL;
+
+err:
+	/* The error buffer belongs to this thread, so keep a copy. */
+	c->errline = linecnt;
+	if ((c->err = malloc(strlen(errget())+1)) != NULL)
+		strcpy(c->err, errget());
+	free(year.spans);
+	free(l.tok);
+	return NULL;
+}
+
+/* Split in into about nthreads chunks, each starting at the beginning of a
+ * line, and parse them in parallel. Returns the number of chunks. */
+static size_t
+parse_chunks(struct chunk *chunks, struct sched *s, struct input *in,
+             int nthreads)
+{
+	pthread_t *threads;
+	bool *started;
+	size_t nchunks, i;
+	char const *p, *bufend;
+
+	nchunks = min((size_t)nthreads, in->len / PARSE_CHUNK_MIN + 1);
+	bufend = in->buf + in->len;
+	p = in->buf;
+	for (i = 0; i < nchunks; ++i) {
+		memset(&chunks[i], 0, sizeof chunks[i]);
+		chunks[i].sched = s;
+		arena_init(&chunks[i].arena);
+		chunks[i].begin = p;
+		if (i+1 == nchunks) {
+			p = bufend;
 		} else {
-			(*entry)->text = malloc_or_exit(strlen(s)+1);
-			strcpy((*entry)->text, s);
+			p = max(p, in->buf + (i+1) * (in->len / nchunks));
+			if ((p = memchr(p, '\n', bufend - p)) == NULL)
+				p = bufend;
+			else
+				++p;
 		}
+		chunks[i].end = p;
+	}
 
-		prev = *entry;
-		entry = &(*entry)->next;
+	/* Any chunk which can't get a thread of its own is parsed right away. */
+	threads = malloc(nchunks * sizeof *threads);
+	started = calloc(nchunks, sizeof *started);
+	for (i = 1; i < nchunks; ++i) {
+		if (threads && started)
+			started[i] = pthread_create(&threads[i], NULL, parse_chunk,
+			                            &chunks[i]) == 0;
+		if (!started || !started[i])
+			parse_chunk(&chunks[i]);
+	}
+	parse_chunk(&chunks[0]);
+	for (i = 1; i < nchunks; ++i) {
+		if (started && started[i])
+			pthread_join(threads[i], NULL);
 	}
+	free(threads);
+	free(started);
+	return nchunks;
+}
 
-	free(line);
-	return true;
+/* Parse the entries in in, appending them to s. Each input starts afresh,
+ * i.e., its first entry needs a description. */
+bool
+parse_entries(struct sched *s, struct input *in, int nthreads)
+{
+	struct chunk *chunks, *c;
+	size_t nchunks, i, j, first, base, cap;
+	char buf[256];
+	long linebase, errline;
+	char const *text;
+	size_t textlen;
+	struct entry *entries, *e;
+	bool ok;
+
+	if ((chunks = malloc(nthreads * sizeof *chunks)) == NULL) {
+		errset("out of memory");
+		return false;
+	}
+	nchunks = parse_chunks(chunks, s, in, nthreads);
+
+	/* Stitch the chunks together in order, resolving what depends on earlier
+	 * chunks: line numbers, ids, and inherited descriptions. Duplicates are
+	 * found afterwards, over the whole schedule. */
+	ok = true;
+	linebase = 0;
+	text = NULL;
+	textlen = 0;
+	first = s->nentries;
+	for (i = 0; i < nchunks && ok; ++i) {
+		c = &chunks[i];
+		errline = c->ok ? LONG_MAX : c->errline;
+		if (c->orphan > 0 && text == NULL && c->orphan < errline) {
+			errset("first entry must have description");
+			errline = c->orphan;
+		} else if (!c->ok) {
+			errset(c->err ? c->err : "out of memory");
+		}
+		for (j = 0; j < c->nwarns && c->warns[j] < errline; ++j) {
+			if (in->name)
+				snprintf(buf, arrlen(buf), "%.200s: line %ld: event never occurs",
+				         in->name, linebase + c->warns[j]);
+			else
+				snprintf(buf, arrlen(buf), "line %ld: event never occurs",
+				         linebase + c->warns[j]);
+			if (s->warn)
+				s->warn(buf);
+		}
+		if (errline != LONG_MAX) {
+			snprintf(buf, arrlen(buf), "line %ld", linebase + errline);
+			erradd(buf);
+			if (in->name)
+				erradd(in->name);
+			ok = false;
+			break;
+		}
+		if (c->n > SIZE_MAX / sizeof *entries - s->nentries) {
+			errset("too many entries");
+			ok = false;
+			break;
+		}
 
-err:
-	snprintf(buf, arrlen(buf), "line %ld", linecnt);
-	erradd(buf);
-	free(line);
-	return false;
+		base = s->nentries;
+		if (s->entries == NULL) {
+			/* The first chunk's table becomes the schedule's. */
+			s->entries = c->entries;
+			s->cap = c->cap;
+			c->entries = NULL;
+		} else if (base + c->n > s->cap) {
+			cap = max(base + c->n, min(2*s->cap, SIZE_MAX / sizeof *entries));
+			if ((entries = realloc(s->entries, cap * sizeof *entries)) == NULL) {
+				errset("out of memory");
+				ok = false;
+				break;
+			}
+			s->entries = entries;
+			s->cap = cap;
+		}
+		if (c->entries != NULL)
+			memcpy(&s->entries[base], c->entries, c->n * sizeof *entries);
+		arena_splice(&s->arena, &c->arena);
+		s->nentries += c->n;
+
+		for (j = 0; j < c->n; ++j) {
+			e = &s->entries[base + j];
+			e->id = e->dup = base + j;
+			if (j < c->norphans) {
+				e->text = text;
+				e->textlen = textlen;
+			}
+		}
+		if (c->text != NULL) {
+			text = c->text;
+			textlen = c->textlen;
+		}
+		linebase += c->nlines;
+	}
+
+	for (i = 0; i < nchunks; ++i) {
+		free(chunks[i].entries);
+		arena_free(&chunks[i].arena);
+		free(chunks[i].warns);
+		free(chunks[i].err);
+	}
+	free(chunks);
+	return ok && sched_dedup(s, first);
 }
 
 bool
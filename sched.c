@@ -0,0 +1,1083 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sres.h"
+
+void
+entry_init(struct entry *e)
+{
+	e->min = 0;
+	e->hour = e->dow = e->dom = e->mon = 0;
+	e->days = NULL;
+	spanarr_init(&e->year);
+	e->text = NULL;
+	e->textlen = 0;
+	e->dur = 0;
+	e->id = 0;
+	e->dup = 0;
+}
+
+bool
+entry_occurs(struct entry *e)
+{
+	size_t i;
+	Spanv year;
+
+	/* The calendar repeats every 400 years, so the day table tells whether
+	 * any year in each span can have a permitted day. */
+	for (i = 0; i < e->year.len; ++i) {
+		year = e->year.spans[i].begin;
+		if (daytab_seekyear(e->days, &year) && year <= e->year.spans[i].end)
+			return true;
+	}
+	return false;
+}
+
+/* Seek ei to the first time >= begin, not setting ei->t. */
+static bool
+entryiter_seekbegin(struct entryiter *ei, struct dtime *begin)
+{
+	int doy;
+
+	bititer_zero(bititer(ei, min));
+	bititer_zero(bititer(ei, hour));
+	spaniter_zero(spaniter(ei, year));
+
+	/* If a field (e.g., year) has been set to a value strictly greater than it
+	 * needs to be set to, the fields representing smaller division of time can
+	 * be set to their smallest value. E.g., if the beginning date is 12 July
+	 * 2020, but the smallest permissible year > 2020 is 2021, then the day
+	 * needn't be 12 July or later; rather, the day (and the hour and minute)
+	 * can be their smallest permissible values. This rule is implemented in
+	 * the following. */
+	if (!spaniter_seek(spaniter(ei, year), begin->year)) return false;
+	ei->yeart = yearmin(ei->dt.year);
+	if (ei->dt.year > begin->year) return entryiter_seekday(ei, 0);
+	doy = dtime2doy(begin);
+	assert(doy >= 0);
+	if (!entryiter_seekday(ei, doy)) return false;
+	if (ei->dt.year > begin->year || ei->doy > doy) return true;
+	if (!bititer_seek(bititer(ei, hour), begin->hour))
+		return entryiter_seekday(ei, doy+1);
+	if (ei->dt.hour > begin->hour) return true;
+	if (bititer_seek(bititer(ei, min), begin->min)) return true;
+	if (bititer_next(bititer(ei, hour)))
+		return entryiter_seekday(ei, doy+1);
+	return true;
+}
+
+bool
+entryiter_init(struct entryiter *ei, struct dtime *begin)
+{
+	if (!entryiter_seekbegin(ei, begin))
+		return false;
+	ei->t = ei->dayt + 60LL*ei->dt.hour + ei->dt.min;
+	return true;
+}
+
+bool
+entryiter_next(struct entryiter *ei)
+{
+	if (bititer_next(bititer(ei, min)) &&
+	    bititer_next(bititer(ei, hour)) &&
+	    !entryiter_seekday(ei, ei->doy+1))
+		return false;
+	ei->t = ei->dayt + 60LL*ei->dt.hour + ei->dt.min;
+	return true;
+}
+
+bool
+entryiter_seekday(struct entryiter *ei, int doy)
+{
+	/* The day table tells directly which days of the current year are
+	 * permitted, so the only loop is over years without any such day. */
+	while (!bits_seek(ei->e->days->days[yeartype(ei->dt.year)], DAYBITS, &doy)) {
+		if (ei->dt.year == YEAR_MAX || !entryiter_seekyear(ei, ei->dt.year+1))
+			return false;
+		doy = 0;
+	}
+	ei->doy = doy;
+	ei->dayt = ei->yeart + 1440LL*doy;
+	dtime_setdoy(&ei->dt, doy);
+	return true;
+}
+
+bool
+entryiter_seekyear(struct entryiter *ei, Spanv year)
+{
+	/* Skip straight over years of the 400-year cycle in which no day is
+	 * permitted, and over year spans containing no such year. */
+	while (spaniter_seek(spaniter(ei, year), year)) {
+		year = ei->dt.year;
+		if (!daytab_seekyear(ei->e->days, &year))
+			return false;
+		if (year <= ei->e->year.spans[ei->yeari].end) {
+			ei->dt.year = year;
+			ei->yeart = yearmin(year);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Whether tab permits every day of every year. */
+static bool
+daytab_isfull(struct daytab *tab)
+{
+	int t;
+
+	for (t = 0; t < NYEARTYPES; ++t) {
+		if (bits_run(tab->days[t], DAYBITS, 0) < 365 + (t >= 7))
+			return false;
+	}
+	return true;
+}
+
+/* Whether ei's entry is permitted on the day after ei's. */
+static bool
+entryiter_nextday(struct entryiter *ei)
+{
+	int doy;
+
+	doy = ei->doy + 1;
+	if (bits_run(ei->e->days->days[yeartype(ei->dt.year)], DAYBITS, doy) > 0)
+		return true;
+	/* Adjacent year spans are merged, so the next year must be in ei's. */
+	return ei->dt.year < ei->e->year.spans[ei->yeari].end &&
+	       (ei->e->days->days[yeartype(ei->dt.year+1)][0] & 1);
+}
+
+/* The number of consecutive minutes from ei->t on (at most max) at each of
+ * which ei's entry occurs. This works a field at a time, so that a run of
+ * whole hours, days, or years costs no more than a single minute. */
+long long
+entryiter_runlen(struct entryiter *ei, long long max)
+{
+	struct entry *e;
+	long long n;
+	uint64_t hour;
+	int hourrun, dayrun, k, doy;
+	Spanv year;
+
+	e = ei->e;
+	hour = e->hour;
+	n = bits_run(&e->min, 60, ei->dt.min);
+	if (ei->dt.min + n < 60 || n >= max)
+		return min(n, max);
+
+	/* The run carries on into the next hour for as long as the entry's
+	 * minutes do from the start of an hour, and into the next day for as
+	 * long as its hours and minutes do from 00:00. */
+	hourrun = bits_run(&e->min, 60, 0);
+	dayrun = hourrun < 60 ? bits_run(&hour, 24, 0) > 0 ? hourrun : 0
+	                      : 60 * bits_run(&hour, 24, 0);
+	if (hourrun < 60) {
+		if (ei->dt.hour < 23)
+			n += bits_run(&hour, 24, ei->dt.hour+1) > 0 ? hourrun : 0;
+		else if (entryiter_nextday(ei))
+			n += dayrun;
+		return min(n, max);
+	}
+	k = bits_run(&hour, 24, ei->dt.hour+1);
+	n += 60LL*k;
+	if (ei->dt.hour+1 + k < 24 || n >= max)
+		return min(n, max);
+	if (dayrun < 1440) {
+		if (entryiter_nextday(ei))
+			n += dayrun;
+		return min(n, max);
+	}
+
+	/* Every minute of each permitted day: count whole days, or if every day
+	 * is permitted, go straight to the end of the year span. */
+	if (daytab_isfull(e->days)) {
+		year = e->year.spans[ei->yeari].end;
+		n = yearmin(year) + 1440LL*(365 + (yeartype(year) >= 7)) - ei->t;
+		return min(n, max);
+	}
+	doy = ei->doy + 1;
+	year = ei->dt.year;
+	while (n < max) {
+		k = bits_run(e->days->days[yeartype(year)], DAYBITS, doy);
+		n += 1440LL*k;
+		if (doy + k < 365 + (yeartype(year) >= 7) ||
+		    year >= e->year.spans[ei->yeari].end)
+			break;
+		++year;
+		doy = 0;
+	}
+	return min(n, max);
+}
+
+/* The reverse of entryiter_init: seek ei to the last time <= end. */
+bool
+entryiter_initrev(struct entryiter *ei, struct dtime *end)
+{
+	int doy;
+
+	bititer_last(bititer(ei, min));
+	bititer_last(bititer(ei, hour));
+	spaniter_last(spaniter(ei, year));
+
+	/* As in entryiter_seekbegin, but with smaller fields set to their
+	 * largest permissible values once a larger one is less than end's. */
+	if (!spaniter_seekrev(spaniter(ei, year), end->year))
+		return false;
+	ei->yeart = yearmin(ei->dt.year);
+	if (ei->dt.year < end->year) {
+		if (!entryiter_seekdayrev(ei, DAYBITS-1))
+			return false;
+		goto done;
+	}
+	doy = dtime2doy(end);
+	assert(doy >= 0);
+	if (!entryiter_seekdayrev(ei, doy))
+		return false;
+	if (ei->dt.year < end->year || ei->doy < doy)
+		goto done;
+	if (!bititer_seekrev(bititer(ei, hour), end->hour)) {
+		if (!entryiter_seekdayrev(ei, doy-1))
+			return false;
+		goto done;
+	}
+	if (ei->dt.hour < end->hour)
+		goto done;
+	if (bititer_seekrev(bititer(ei, min), end->min))
+		goto done;
+	if (bititer_prev(bititer(ei, hour)) && !entryiter_seekdayrev(ei, doy-1))
+		return false;
+done:
+	ei->t = ei->dayt + 60LL*ei->dt.hour + ei->dt.min;
+	return true;
+}
+
+/* The reverse of entryiter_next. */
+bool
+entryiter_prev(struct entryiter *ei)
+{
+	if (bititer_prev(bititer(ei, min)) &&
+	    bititer_prev(bititer(ei, hour)) &&
+	    !entryiter_seekdayrev(ei, ei->doy-1))
+		return false;
+	ei->t = ei->dayt + 60LL*ei->dt.hour + ei->dt.min;
+	return true;
+}
+
+bool
+entryiter_seekdayrev(struct entryiter *ei, int doy)
+{
+	while (!bits_seekrev(ei->e->days->days[yeartype(ei->dt.year)], DAYBITS,
+	                     &doy)) {
+		if (ei->dt.year == YEAR_MIN ||
+		    !entryiter_seekyearrev(ei, ei->dt.year-1))
+			return false;
+		doy = DAYBITS-1;
+	}
+	ei->doy = doy;
+	ei->dayt = ei->yeart + 1440LL*doy;
+	dtime_setdoy(&ei->dt, doy);
+	return true;
+}
+
+bool
+entryiter_seekyearrev(struct entryiter *ei, Spanv year)
+{
+	while (spaniter_seekrev(spaniter(ei, year), year)) {
+		year = ei->dt.year;
+		if (!daytab_seekyearrev(ei->e->days, &year))
+			return false;
+		if (year >= ei->e->year.spans[ei->yeari].begin) {
+			ei->dt.year = year;
+			ei->yeart = yearmin(year);
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+heap_init(struct heapkey *heap, size_t len)
+{
+	size_t i;
+
+	for (i = len/2; i > 0; --i)
+		heap_siftdown(heap, len, i-1);
+}
+
+void
+heap_siftdown(struct heapkey *heap, size_t len, size_t i)
+{
+	size_t c;
+	struct heapkey k;
+
+	/* Min-heap on (t, i): heap[0] is always the next event. Ties are broken
+	 * by input order (iterators are in input order) so that simultaneous
+	 * events are always output in the order they were given. */
+	k = heap[i];
+	while ((c = 2*i + 1) < len) {
+		if (c+1 < len && (heap[c+1].t < heap[c].t ||
+		    (heap[c+1].t == heap[c].t && heap[c+1].i < heap[c].i)))
+			++c;
+		if (k.t < heap[c].t || (k.t == heap[c].t && k.i < heap[c].i))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = k;
+}
+
+void
+spanarr_init(struct spanarr *arr)
+{
+	arr->spans = NULL;
+	arr->len = 0;
+	arr->cap = 0;
+}
+
+/* Add span to arr, leaving it unsorted; see spanarr_coalesce. */
+bool
+spanarr_append(struct spanarr *arr, struct span span)
+{
+	size_t cap;
+	struct span *spans;
+
+	if (arr->len == arr->cap) { /* Need to grow? */
+		if (arr->cap > SIZE_MAX / 2 / sizeof *spans) {
+			errset("out of memory");
+			return false;
+		}
+		cap = arr->cap > 0 ? 2*arr->cap : 4;
+		if ((spans = realloc(arr->spans, cap * sizeof *spans)) == NULL) {
+			errset("out of memory");
+			return false;
+		}
+		arr->spans = spans;
+		arr->cap = cap;
+	}
+	arr->spans[arr->len++] = span;
+	return true;
+}
+
+static int
+span_cmp(void const *a, void const *b)
+{
+	Spanv x, y;
+
+	x = ((struct span const *)a)->begin;
+	y = ((struct span const *)b)->begin;
+	return (x > y) - (x < y);
+}
+
+/* Sort the spans and merge those which overlap or are adjacent, so that the
+ * spans are disjoint and in order, as the spaniter functions need. */
+void
+spanarr_coalesce(struct spanarr *arr)
+{
+	size_t i, j;
+
+	if (arr->len == 0)
+		return;
+	qsort(arr->spans, arr->len, sizeof *arr->spans, span_cmp);
+	i = 0;
+	for (j = 1; j < arr->len; ++j) {
+		if (!span_try_merge(&arr->spans[i], &arr->spans[j]))
+			arr->spans[++i] = arr->spans[j];
+	}
+	arr->len = i+1;
+}
+
+void
+spaniter_zero(struct spanarr *arr, Spanv *val, size_t *idx)
+{
+	assert(arr->len > 0);
+	*idx = 0;
+	*val = arr->spans[0].begin;
+}
+
+bool
+spaniter_seek(struct spanarr *arr, Spanv *val, size_t *idx, Spanv target)
+{
+	size_t lo, hi, step, mid;
+
+	/* The first span from *idx on which ends at or after target. Gallop from
+	 * *idx, since seeks are usually short, and then search the last step. */
+	lo = hi = *idx;
+	for (step = 1; hi < arr->len && arr->spans[hi].end < target; step *= 2) {
+		lo = hi+1;
+		hi = step < arr->len - hi ? hi + step : arr->len;
+	}
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (arr->spans[mid].end < target)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	if (lo >= arr->len)
+		return false;
+	*val = max(arr->spans[lo].begin, target);
+	*idx = lo;
+	return true;
+}
+
+bool
+spaniter_next(struct spanarr *arr, Spanv *val, size_t *idx)
+{
+	assert(*idx < arr->len);
+	assert(inrange(*val, arr->spans[*idx].begin, arr->spans[*idx].end));
+	if (*val < arr->spans[*idx].end) {
+		++*val;
+	} else {
+		++*idx;
+		if (*idx >= arr->len) { /* Iter wrapped around? */
+			spaniter_zero(arr, val, idx);
+			return true;
+		} else {
+			*val = arr->spans[*idx].begin;
+		}
+	}
+	return false;
+}
+
+void
+spaniter_last(struct spanarr *arr, Spanv *val, size_t *idx)
+{
+	assert(arr->len > 0);
+	*idx = arr->len - 1;
+	*val = arr->spans[*idx].end;
+}
+
+bool
+spaniter_seekrev(struct spanarr *arr, Spanv *val, size_t *idx, Spanv target)
+{
+	size_t lo, hi, step, mid;
+
+	/* The last span up to *idx which begins at or before target, found as
+	 * in spaniter_seek but galloping down. lo and hi are one past the
+	 * indexes, so that "none" is 0. */
+	lo = hi = *idx + 1;
+	for (step = 1; lo > 0 && arr->spans[lo-1].begin > target; step *= 2) {
+		hi = lo-1;
+		lo = step < lo ? lo - step : 0;
+	}
+	while (lo < hi) {
+		mid = lo + (hi-lo+1)/2;
+		if (arr->spans[mid-1].begin > target)
+			hi = mid-1;
+		else
+			lo = mid;
+	}
+	if (lo == 0)
+		return false;
+	*val = min(arr->spans[lo-1].end, target);
+	*idx = lo-1;
+	return true;
+}
+
+bool
+span_try_merge(struct span *a, struct span *b)
+{
+	if ((b->begin - a->end <= 1 && a->begin <= b->end) ||
+			(a->begin - b->end <= 1 && b->begin <= a->end)) {
+		a->begin = min(a->begin, b->begin);
+		a->end = max(a->end, b->end);
+		return true;
+	}
+	return false;
+}
+
+void
+bititer_zero(uint64_t mask, Spanv *val)
+{
+	assert(mask != 0);
+	*val = ctz64(mask);
+}
+
+bool
+bititer_seek(uint64_t mask, Spanv *val, Spanv target)
+{
+	assert(inrange(target, 0, 63));
+	mask &= ~((UINT64_C(1) << target) - 1); /* Drop the bits below target. */
+	if (mask == 0)
+		return false;
+	*val = ctz64(mask);
+	return true;
+}
+
+bool
+bititer_next(uint64_t mask, Spanv *val)
+{
+	assert(inrange(*val, 0, 63) && (mask >> *val & 1));
+	/* Drop the bits up to and including *val. When *val == 63, the shift
+	 * yields 0 and the whole mask is dropped. */
+	if ((mask & ~((UINT64_C(2) << *val) - 1)) == 0) { /* Iter wrapped around? */
+		bititer_zero(mask, val);
+		return true;
+	}
+	*val = ctz64(mask & ~((UINT64_C(2) << *val) - 1));
+	return false;
+}
+
+void
+bititer_last(uint64_t mask, Spanv *val)
+{
+	assert(mask != 0);
+	*val = top64(mask);
+}
+
+bool
+bititer_seekrev(uint64_t mask, Spanv *val, Spanv target)
+{
+	assert(inrange(target, 0, 63));
+	/* Drop the bits above target. When target == 63, the shift yields 0 and
+	 * nothing is dropped. */
+	mask &= (UINT64_C(2) << target) - 1;
+	if (mask == 0)
+		return false;
+	*val = top64(mask);
+	return true;
+}
+
+bool
+bititer_prev(uint64_t mask, Spanv *val)
+{
+	assert(inrange(*val, 0, 63) && (mask >> *val & 1));
+	if ((mask & ((UINT64_C(1) << *val) - 1)) == 0) { /* Iter wrapped around? */
+		bititer_last(mask, val);
+		return true;
+	}
+	*val = top64(mask & ((UINT64_C(1) << *val) - 1));
+	return false;
+}
+
+bool
+bits_seek(uint64_t const *bits, int nbits, int *i)
+{
+	int w;
+	uint64_t m;
+
+	if (*i < 0 || *i >= nbits)
+		return false;
+	w = *i / 64;
+	m = bits[w] & (UINT64_MAX << (*i % 64)); /* Drop the bits before *i. */
+	while (m == 0) {
+		if (++w == (nbits + 63) / 64)
+			return false;
+		m = bits[w];
+	}
+	*i = 64*w + ctz64(m);
+	return true;
+}
+
+/* Like bits_seek, but for the last set bit <= *i. */
+bool
+bits_seekrev(uint64_t const *bits, int nbits, int *i)
+{
+	int w;
+	uint64_t m;
+
+	if (*i < 0)
+		return false;
+	if (*i >= nbits)
+		*i = nbits - 1;
+	w = *i / 64;
+	m = bits[w] & (UINT64_MAX >> (63 - *i % 64)); /* Drop the bits after *i. */
+	while (m == 0) {
+		if (w-- == 0)
+			return false;
+		m = bits[w];
+	}
+	*i = 64*w + top64(m);
+	return true;
+}
+
+/* The number of consecutive bits set from bit i on. */
+int
+bits_run(uint64_t const *bits, int nbits, int i)
+{
+	int n, w;
+	uint64_t m;
+
+	if (i < 0 || i >= nbits)
+		return 0;
+	w = i / 64;
+	m = ~bits[w] >> (i % 64); /* The unset bits from i on. */
+	n = 0;
+	while (m == 0) {
+		n += 64 - (i + n) % 64;
+		if (++w == (nbits + 63) / 64)
+			return min(n, nbits - i);
+		m = ~bits[w];
+	}
+	return min(n + ctz64(m), nbits - i);
+}
+
+struct daytab *
+daytab_get(struct sched *s, uint32_t dow, uint32_t dom, uint32_t mon)
+{
+	/* Many entries share their day constraints, so identical day tables are
+	 * only built once. The table is shared by the parsing threads. */
+	struct daytab **p, *tab;
+	uint32_t h;
+
+	h = (dow * 2654435761u) ^ (dom * 40503u) ^ (mon * 2246822519u);
+	pthread_mutex_lock(&s->lock);
+	for (p = &s->daytabs[h % DAYTAB_NBUCKETS]; *p; p = &(*p)->next) {
+		if ((*p)->dow == dow && (*p)->dom == dom && (*p)->mon == mon)
+			break;
+	}
+	if (*p == NULL && (*p = malloc(sizeof **p)) != NULL) {
+		daytab_fill(*p, dow, dom, mon);
+		(*p)->next = NULL;
+	}
+	tab = *p;
+	pthread_mutex_unlock(&s->lock);
+	if (tab == NULL)
+		errset("out of memory");
+	return tab;
+}
+
+bool
+sched_init(struct sched *s)
+{
+	size_t i;
+
+	s->entries = NULL;
+	s->nentries = s->cap = 0;
+	arena_init(&s->arena);
+	s->dups = NULL;
+	s->ndups = s->dupcap = 0;
+	s->inputs = NULL;
+	s->ninputs = 0;
+	for (i = 0; i < DAYTAB_NBUCKETS; ++i)
+		s->daytabs[i] = NULL;
+	s->warn = NULL;
+	if (pthread_mutex_init(&s->lock, NULL) != 0) {
+		errset("failed to create lock");
+		return false;
+	}
+	return true;
+}
+
+bool
+sched_load(struct sched *s, char const *path, int nthreads)
+{
+	struct input *inputs;
+
+	inputs = realloc(s->inputs, (s->ninputs+1) * sizeof *s->inputs);
+	if (inputs == NULL) {
+		errset("out of memory");
+		return false;
+	}
+	s->inputs = inputs;
+	if (!input_open(&s->inputs[s->ninputs], path))
+		return false;
+	/* The input is kept as long as s: the descriptions point into it. */
+	if (sresc_is(&s->inputs[s->ninputs]))
+		return sresc_load(s, &s->inputs[s->ninputs++]);
+	return parse_entries(s, &s->inputs[s->ninputs++], nthreads);
+}
+
+static uint64_t
+entry_hash(struct entry *e)
+{
+	uint64_t h;
+	size_t i;
+
+	/* FNV-1a over the text, then the duration. */
+	h = UINT64_C(14695981039346656037);
+	for (i = 0; i < e->textlen; ++i)
+		h = (h ^ (unsigned char)e->text[i]) * UINT64_C(1099511628211);
+	return (h ^ (uint64_t)e->dur) * UINT64_C(1099511628211);
+}
+
+/* Find the slot in s->dups for an entry like e: either the slot of the first
+ * entry with the same text and duration, or the empty slot where e goes. */
+static size_t *
+dups_slot(struct sched *s, struct entry *e, uint64_t h)
+{
+	size_t i, *p;
+	struct entry *d;
+
+	for (i = h & (s->dupcap-1);; i = (i+1) & (s->dupcap-1)) {
+		p = &s->dups[i];
+		if (*p == SIZE_MAX)
+			return p;
+		d = &s->entries[*p];
+		if (d->dur == e->dur && d->textlen == e->textlen &&
+		    (d->text == e->text || !memcmp(d->text, e->text, e->textlen)))
+			return p;
+	}
+}
+
+static bool
+dups_grow(struct sched *s)
+{
+	size_t *old, oldcap, i;
+
+	old = s->dups;
+	oldcap = s->dupcap;
+	if (oldcap > SIZE_MAX / 2 / sizeof *s->dups) {
+		errset("too many entries");
+		return false;
+	}
+	s->dupcap = oldcap > 0 ? 2*oldcap : 1024;
+	if ((s->dups = malloc(s->dupcap * sizeof *s->dups)) == NULL) {
+		s->dups = old;
+		s->dupcap = oldcap;
+		errset("out of memory");
+		return false;
+	}
+	for (i = 0; i < s->dupcap; ++i)
+		s->dups[i] = SIZE_MAX;
+	for (i = 0; i < oldcap; ++i) {
+		if (old[i] != SIZE_MAX)
+			*dups_slot(s, &s->entries[old[i]], entry_hash(&s->entries[old[i]])) =
+				old[i];
+	}
+	free(old);
+	return true;
+}
+
+/* Whether every occurrence of b is also one of a. */
+static bool
+entry_covers(struct entry *a, struct entry *b)
+{
+	size_t i, j;
+	int t, w;
+
+	if ((b->min & ~a->min) || (b->hour & ~a->hour))
+		return false;
+	if (a->days != b->days) {
+		for (t = 0; t < NYEARTYPES; ++t) {
+			for (w = 0; w < DAYWORDS; ++w) {
+				if (b->days->days[t][w] & ~a->days->days[t][w])
+					return false;
+			}
+		}
+	}
+	/* Both span arrays are sorted and merged, so each span of b must be in a
+	 * single span of a. */
+	for (i = j = 0; i < b->year.len; ++i) {
+		while (j < a->year.len && a->year.spans[j].end < b->year.spans[i].begin)
+			++j;
+		if (j == a->year.len || a->year.spans[j].begin > b->year.spans[i].begin ||
+		    a->year.spans[j].end < b->year.spans[i].end)
+			return false;
+	}
+	return true;
+}
+
+/* Drop the entries from from on which are covered by an earlier entry with
+ * the same text and duration: the earlier one always reaches their times
+ * first, so they are never reported anyway. The rest are moved down to keep
+ * the table contiguous. This is only an optimization, so it is skipped if
+ * there is no memory for it. */
+static void
+sched_prune(struct sched *s, size_t from)
+{
+	size_t *prev, *last, *map;
+	size_t n, i, j, k, h, scan, dropped;
+	struct entry *e;
+	bool covered;
+
+	n = s->nentries;
+	prev = malloc(max(n, 1) * sizeof *prev);
+	last = malloc(max(n, 1) * sizeof *last);
+	map = malloc(max(n - from, 1) * sizeof *map);
+	if (prev == NULL || last == NULL || map == NULL)
+		goto done;
+
+	/* Kept entries with the same dup are chained from last[dup] through
+	 * prev, newest first. Positions are after moving. */
+	dropped = 0;
+	for (i = 0; i < n; ++i) {
+		e = &s->entries[i];
+		if (e->dup < from)
+			h = e->dup;
+		else if (e->dup == i)
+			h = i - dropped;
+		else
+			h = map[e->dup - from];
+		covered = false;
+		if (i >= from && e->dup != i) {
+			k = last[h];
+			for (scan = 0; k != SIZE_MAX && scan < PRUNE_SCAN; ++scan) {
+				if ((covered = entry_covers(&s->entries[k], e)))
+					break;
+				k = prev[k];
+			}
+		}
+		if (covered) {
+			++dropped;
+			continue;
+		}
+		j = i - dropped;
+		if (j != i) {
+			s->entries[j] = *e;
+			s->entries[j].id = j;
+			s->entries[j].dup = h;
+		}
+		if (i >= from)
+			map[i - from] = j;
+		prev[j] = j == h ? SIZE_MAX : last[h];
+		last[h] = j;
+	}
+	if (dropped == 0)
+		goto done;
+	s->nentries -= dropped;
+	for (i = 0; i < s->dupcap; ++i) {
+		if (s->dups[i] != SIZE_MAX && s->dups[i] >= from)
+			s->dups[i] = map[s->dups[i] - from];
+	}
+
+done:
+	free(prev);
+	free(last);
+	free(map);
+}
+
+/* Entries with the same text and duration describe the same event, wherever
+ * they are. Point each of the entries from from on at the first such entry
+ * in s, share its text, and drop those which are redundant. */
+bool
+sched_dedup(struct sched *s, size_t from)
+{
+	struct entry *e;
+	size_t i, *p;
+
+	for (i = from; i < s->nentries; ++i) {
+		/* Keep the table at most half full. */
+		if (s->ndups >= s->dupcap / 2 && !dups_grow(s))
+			return false;
+		e = &s->entries[i];
+		p = dups_slot(s, e, entry_hash(e));
+		if (*p == SIZE_MAX) {
+			*p = e->dup = i;
+			++s->ndups;
+		} else {
+			e->dup = *p;
+			e->text = s->entries[*p].text;
+		}
+	}
+	sched_prune(s, from);
+	return true;
+}
+
+void
+sched_free(struct sched *s)
+{
+	struct daytab *tab, *next;
+	size_t i;
+
+	free(s->entries);
+	arena_free(&s->arena);
+	free(s->dups);
+	for (i = 0; i < DAYTAB_NBUCKETS; ++i) {
+		for (tab = s->daytabs[i]; tab; tab = next) {
+			next = tab->next;
+			free(tab);
+		}
+	}
+	for (i = 0; i < s->ninputs; ++i)
+		input_close(&s->inputs[i]);
+	free(s->inputs);
+	pthread_mutex_destroy(&s->lock);
+}
+
+bool
+cursor_open(struct cursor *c, struct sched *s, struct tz *tz,
+            long long begint, long long endt)
+{
+	return cursor_openpart(c, s, tz, begint, endt, 0, 1);
+}
+
+static bool
+cursor_openany(struct cursor *c, struct sched *s, struct tz *tz,
+               long long begint, long long endt, size_t part, size_t nparts,
+               bool rev)
+{
+	struct dtime from;
+	struct entry *e;
+	size_t i;
+	bool ok;
+
+	c->tz = tz;
+	c->begint = begint;
+	c->endt = endt;
+	c->rev = rev;
+	c->n = 0;
+	c->eis = malloc(max(s->nentries, 1) * sizeof *c->eis);
+	c->heap = malloc(max(s->nentries, 1) * sizeof *c->heap);
+	c->last = malloc(max(s->nentries, 1) * sizeof *c->last);
+	if (c->eis == NULL || c->heap == NULL || c->last == NULL) {
+		cursor_close(c);
+		errset("out of memory");
+		return false;
+	}
+	if (!min2dtime(&from, rev ? endt : begint)) {
+		cursor_close(c);
+		return false;
+	}
+	for (i = 0; i < s->nentries; ++i)
+		/* No event can occur this early, so nothing matches this. */
+		c->last[i] = LLONG_MIN;
+	for (i = 0; i < s->nentries; ++i) {
+		e = &s->entries[i];
+		if (e->dup % nparts != part)
+			continue;
+		c->eis[c->n].e = e;
+		ok = rev ? entryiter_initrev(&c->eis[c->n], &from)
+		         : entryiter_init(&c->eis[c->n], &from);
+		if (ok) {
+			/* Going backwards, the heap is on the times' complements, so
+			 * that the latest comes first. */
+			c->heap[c->n].t = rev ? ~c->eis[c->n].t : c->eis[c->n].t;
+			c->heap[c->n].i = c->n;
+			++c->n;
+		}
+	}
+	heap_init(c->heap, c->n);
+	return true;
+}
+
+/* Like cursor_open, but only for the entries e with e->dup % nparts == part,
+ * so that the work can be split among several cursors. */
+bool
+cursor_openpart(struct cursor *c, struct sched *s, struct tz *tz,
+                long long begint, long long endt, size_t part, size_t nparts)
+{
+	return cursor_openany(c, s, tz, begint, endt, part, nparts, false);
+}
+
+/* Like cursor_open, but cursor_next then goes backwards from endt to begint.
+ * Occurrences which begin at the same time still come in input order. */
+bool
+cursor_openrev(struct cursor *c, struct sched *s, struct tz *tz,
+               long long begint, long long endt)
+{
+	return cursor_openany(c, s, tz, begint, endt, 0, 1, true);
+}
+
+/* Pull the next occurrence into *occ, if there is one. occ->e, occ->t, and
+ * occ->dt give the entry, and when it begins. */
+bool
+cursor_next(struct cursor *c, struct entryiter *occ)
+{
+	struct heapkey *k;
+	struct entryiter *ei;
+	bool found;
+
+	while (c->n > 0) {
+		k = &c->heap[0];
+		if (c->rev ? ~k->t < c->begint : k->t > c->endt) {
+			/* Every remaining iterator is past the end. */
+			c->n = 0;
+			break;
+		}
+		/* Entries with the same text and duration describe the same event, so
+		 * only the first of them to reach a given time is reported. */
+		ei = &c->eis[k->i];
+		found = ei->t != c->last[ei->e->dup] &&
+		        /* Skip times which don't exist locally (e.g., when DST
+		         * starts). */
+		        (c->tz == NULL || !tz_isgap(c->tz, ei->t));
+		if (found) {
+			*occ = *ei;
+			c->last[ei->e->dup] = ei->t;
+		}
+		if (c->rev ? entryiter_prev(ei) : entryiter_next(ei))
+			k->t = c->rev ? ~ei->t : ei->t;
+		else
+			/* The iterator is exhausted. */
+			*k = c->heap[--c->n];
+		heap_siftdown(c->heap, c->n, 0);
+		if (found)
+			return true;
+	}
+	return false;
+}
+
+/* Like cursor_next, but pull the whole run of occurrences of an event at
+ * consecutive minutes, of which there are *n, into *occ. The runs of one
+ * event don't overlap, and are in order of their first occurrences, and a
+ * run never takes in a time which doesn't exist locally. A cursor gives
+ * either occurrences or runs, not both, and only goes forwards for runs. */
+bool
+cursor_nextrun(struct cursor *c, struct entryiter *occ, long long *n)
+{
+	struct heapkey *k;
+	struct entryiter *ei;
+	struct dtime dt;
+	long long len, skip, gapbegin, gapend, *last;
+	bool found;
+
+	while (c->n > 0) {
+		k = &c->heap[0];
+		if (k->t > c->endt) {
+			c->n = 0;
+			break;
+		}
+		ei = &c->eis[k->i];
+		last = &c->last[ei->e->dup];
+		found = false;
+		if (ei->t <= *last) {
+			/* An entry like this one has already reported the times up to
+			 * *last, so take up after them. */
+			skip = *last + 1 - ei->t;
+		} else {
+			/* The minutes left up to the end, which may be too many to count
+			 * (e.g., if it is LLONG_MAX). */
+			if (ei->t < 0 && c->endt > LLONG_MAX + ei->t)
+				len = LLONG_MAX;
+			else
+				len = c->endt - ei->t < LLONG_MAX ? c->endt - ei->t + 1
+				                                 : LLONG_MAX;
+			len = entryiter_runlen(ei, len);
+			found = true;
+			/* Cut the run short at a gap in local time, or skip the gap if
+			 * the run begins in it. */
+			if (c->tz != NULL && tz_nextgap(c->tz, ei->t, &gapbegin, &gapend) &&
+			    gapbegin < ei->t + len) {
+				if (gapbegin <= ei->t)
+					found = false;
+				else
+					len = gapbegin - ei->t;
+			}
+			skip = found ? len : gapend - ei->t;
+		}
+		if (found) {
+			*occ = *ei;
+			*n = len;
+			*last = ei->t + len - 1;
+		}
+		if (skip == 1 ? entryiter_next(ei) :
+		    min2dtime(&dt, ei->t + skip) && entryiter_init(ei, &dt))
+			k->t = ei->t;
+		else
+			*k = c->heap[--c->n];
+		heap_siftdown(c->heap, c->n, 0);
+		if (found)
+			return true;
+	}
+	return false;
+}
+
+void
+cursor_close(struct cursor *c)
+{
+	free(c->eis);
+	free(c->heap);
+	free(c->last);
+	c->eis = NULL;
+	c->heap = NULL;
+	c->last = NULL;
+	c->n = 0;
+}
+
@@ -1,9 +1,15 @@
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -13,279 +19,1038 @@
 
 char *argv0;
 
-/* TODO DST is broken: times in skipped hour are included in output */
-/* TODO iteration idea: work in Unix time, adding to a single llong counter */
+void *
+malloc_or_exit(size_t n)
+{
+	void *ptr;
+
+	if ((ptr = malloc(n)) == NULL)
+		errexit("out of memory");
+	return ptr;
+}
+
+void *
+realloc_or_exit(void *ptr, size_t n)
+{
+	if ((ptr = realloc(ptr, n)) == NULL)
+		errexit("out of memory");
+	return ptr;
+}
 
 void
-entry_init(struct entry *e)
+errexit(char const *msg)
 {
-	spanarr_init(&e->min);
-	spanarr_init(&e->hour);
-	spanarr_init(&e->dow);
-	spanarr_init(&e->dom);
-	spanarr_init(&e->mon);
-	spanarr_init(&e->year);
-	e->text = NULL;
-	e->dur = 0;
-	e->next = NULL;
+	fprintf(stderr, "error: %s\n", msg);
+	exit(EXIT_FAILURE);
 }
 
-bool
-entryiter_init(struct entryiter *ei, struct dtime *begin)
+void
+warn(char const *msg)
 {
-	size_t i;
-	int dowv;
-
-	spaniter_zero(spaniter(ei, min));
-	spaniter_zero(spaniter(ei, hour));
-	spaniter_zero(spaniter(ei, dom));
-	spaniter_zero(spaniter(ei, mon));
-	spaniter_zero(spaniter(ei, year));
-
-	for (i = 0; i < 7; ++i)
-		ei->dow[i] = false;
-	for (i = 0; i < ei->e->dow.len; ++i) {
-		dowv = ei->e->dow.spans[i].begin;
-		for (; dowv <= ei->e->dow.spans[i].end; ++dowv)
-			ei->dow[dowv] = true;
-	}
-
-	/* If a field (e.g., year) has been set to a value strictly greater than it
-	 * needs to be set to, the fields representing smaller division of time can
-	 * be set to their smallest value. E.g., if the beginning date is 12 July
-	 * 2020, but the smallest permissible year > 2020 is 2021, then the month
-	 * needn't be July or greater; rather, the month (and the dom, hour, and
-	 * minute) can be their smallest permissible values. This rule is
-	 * implemented in the following. */
-	if (!spaniter_seek(spaniter(ei, year), begin->year)) return false;
-	if (ei->dt.year > begin->year) goto done;
-	if (!spaniter_seek(spaniter(ei, mon), begin->mon)) goto next_year;
-	if (ei->dt.mon > begin->mon) goto done;
-	if (!spaniter_seek(spaniter(ei, dom), begin->dom)) goto next_mon;
-	if (ei->dt.dom > begin->dom) goto done;
-	if (!spaniter_seek(spaniter(ei, hour), begin->hour)) goto next_dom;
-	if (ei->dt.hour > begin->hour) goto done;
-	if (spaniter_seek(spaniter(ei, min), begin->min)) goto done;
-	if (!spaniter_next(spaniter(ei, hour))) goto done;
-next_dom:
-	if (!spaniter_next(spaniter(ei, dom))) goto done;
-next_mon:
-	if (!spaniter_next(spaniter(ei, mon))) goto done;
-next_year:
-	if (spaniter_next(spaniter(ei, year))) return false;
-
-done:
-	assert(dtime_cmp(&ei->dt, begin) >= 0);
-	return entryiter_stabilizedmy(ei);
+	fprintf(stderr, "warning: %s\n", msg);
 }
 
-bool
-entryiter_next(struct entryiter *ei)
+/* For -p, the entries are split among producer threads, each of which
+ * formats its occurrences into a ring of its own. The main thread merges the
+ * rings in order of (time, id), which is the order a single thread would
+ * have printed them in. */
+struct occ {
+	long long t;
+	size_t id;
+	struct strbuf out;
+	char *err; /* Non-NULL if formatting failed. */
+};
+
+/* Single producer, single consumer: only the producer stores head, and only
+ * the consumer stores tail. */
+struct ring {
+	struct occ occs[RING_LEN];
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_bool done; /* The producer has pushed its last occurrence. */
+};
+
+static bool
+ring_push(struct ring *r, struct fmt *fmt, struct tz *tz, struct entryiter *ei)
 {
-	if (spaniter_next(spaniter(ei, min)) &&
-	    spaniter_next(spaniter(ei, hour))) {
-		if (spaniter_next(spaniter(ei, dom)) &&
-		    spaniter_next(spaniter(ei, mon)) &&
-		    spaniter_next(spaniter(ei, year)))
-			return false; /* Year wrapped around. */
-		return entryiter_stabilizedmy(ei);
+	size_t h;
+	struct occ *o;
+	bool ok;
+
+	h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	while (h - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_LEN)
+		sched_yield(); /* Full. */
+	o = &r->occs[h % RING_LEN];
+	o->t = ei->t;
+	o->id = ei->e->id;
+	o->out.len = 0;
+	o->err = NULL;
+	out_capture(&o->out);
+	ok = entryiter_printf(fmt, tz, ei, 1);
+	out_capture(NULL);
+	if (!ok) {
+		/* Reported by the consumer once everything before it is printed. */
+		o->err = malloc_or_exit(strlen(errget())+1);
+		strcpy(o->err, errget());
 	}
-	return true;
+	atomic_store_explicit(&r->head, h+1, memory_order_release);
+	return ok;
 }
 
-bool
-entryiter_stabilizedmy(struct entryiter *ei)
+/* The next occurrence in r, or NULL once r has no more. */
+static struct occ *
+ring_front(struct ring *r)
 {
-	if (!dtime_calcdow(&ei->dt) || !ei->dow[ei->dt.dow]) {
-	    spaniter_zero(spaniter(ei, min));
-	    spaniter_zero(spaniter(ei, hour));
-		do {
-			if (spaniter_next(spaniter(ei, dom)) &&
-			    spaniter_next(spaniter(ei, mon)) &&
-			    spaniter_next(spaniter(ei, year)))
-				return false; /* Year wrapped around. */
-		} while (!dtime_calcdow(&ei->dt) || !ei->dow[ei->dt.dow]);
+	size_t t;
+	bool done;
+
+	t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	for (;;) {
+		/* Read done first: the producer sets it after its last push. */
+		done = atomic_load_explicit(&r->done, memory_order_acquire);
+		if (atomic_load_explicit(&r->head, memory_order_acquire) != t)
+			return &r->occs[t % RING_LEN];
+		if (done)
+			return NULL;
+		sched_yield(); /* Empty. */
 	}
-	return true;
 }
 
-bool
-entryiter_eq(struct entryiter *a, struct entryiter *b)
+static void
+ring_pop(struct ring *r)
 {
-	/* When two entries have the same text in the input, they are given the
-	 * same text pointer, so comparing pointers below is sufficient (instead
-	 * of, e.g., using strcmp). */
-	return dtime_cmp(&a->dt, &b->dt) == 0 &&
-		a->e->text == b->e->text &&
-		a->e->dur == b->e->dur;
+	atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
 }
 
-void
-entryiter_sort(struct entryiter *eis, size_t len)
+/* For -j, [BEGIN, END] is cut into windows which are expanded on separate
+ * threads, each into its own buffer. The buffers are written out in window
+ * order, so the output is the same as expanding the whole range at once. A
+ * window only starts once all but nslots-1 earlier windows are written out,
+ * which bounds the memory used. */
+struct window {
+	struct strbuf out;
+	bool done;
+	bool ok;
+	char *err;
+};
+
+struct expansion {
+	struct sched *sched;
+	long long begint, endt, winlen;
+	struct fmt *fmt;
+	struct tz *tz;
+	struct window *wins;
+	size_t nwins, nslots;
+	size_t next;    /* The next window to be expanded. */
+	size_t emitted; /* The number of windows written out. */
+	pthread_mutex_t lock;
+	pthread_cond_t space; /* Signalled when a window is written out. */
+	pthread_cond_t done;  /* Signalled when a window is expanded. */
+};
+
+static void *
+expand_windows(void *arg)
 {
-	size_t i, j;
-	struct entryiter t;
-
-	/* Insertion sort. */
-	for (i = 1; i < len; ++i) {
-		for (j = i; j > 0 && dtime_cmp(&eis[j].dt, &eis[j-1].dt) <= 0; --j) {
-			if (entryiter_eq(&eis[j], &eis[j-1]))
-				eis[j].skip = true;
-			t = eis[j];
-			eis[j] = eis[j-1];
-			eis[j-1] = t;
+	struct expansion *x;
+	struct cursor c;
+	struct entryiter occ;
+	long long wbegin, wend;
+	struct window *win;
+	size_t w;
+
+	x = arg;
+	for (;;) {
+		pthread_mutex_lock(&x->lock);
+		while (x->next < x->nwins && x->next >= x->emitted + x->nslots)
+			pthread_cond_wait(&x->space, &x->lock);
+		w = x->next;
+		if (w < x->nwins)
+			++x->next;
+		pthread_mutex_unlock(&x->lock);
+		if (w >= x->nwins)
+			break;
+
+		win = &x->wins[w % x->nslots];
+		wbegin = x->begint + (long long)w * x->winlen;
+		wend = min(wbegin + x->winlen - 1, x->endt);
+		win->out.len = 0;
+		out_capture(&win->out);
+		/* A time belongs to only one window, so no occurrence is lost or
+		 * printed twice. */
+		win->ok = cursor_open(&c, x->sched, x->tz, wbegin, wend);
+		if (win->ok) {
+			while (cursor_next(&c, &occ) &&
+			       (win->ok = entryiter_printf(x->fmt, x->tz, &occ, 1)))
+				;
+			cursor_close(&c);
+		}
+		if (!win->ok) {
+			/* The error buffer belongs to this thread, so keep a copy. */
+			win->err = malloc_or_exit(strlen(errget())+1);
+			strcpy(win->err, errget());
 		}
+		out_capture(NULL);
+
+		pthread_mutex_lock(&x->lock);
+		win->done = true;
+		pthread_cond_broadcast(&x->done);
+		pthread_mutex_unlock(&x->lock);
 	}
+	return NULL;
 }
 
-void
-entryiter_resort(struct entryiter *eis, size_t len)
+static void
+expand_parallel(struct sched *sched, long long begint, long long endt,
+                struct fmt *fmt, struct tz *tz, int nthreads)
 {
-	size_t i;
-	struct entryiter t;
+	struct expansion x;
+	pthread_t *threads;
+	struct window *win;
+	long long span;
+	size_t w;
+	int i, nstarted;
 
-	for (i = 1; i < len && dtime_cmp(&eis[i-1].dt, &eis[i].dt) >= 0; ++i) {
-		if (entryiter_eq(&eis[i-1], &eis[i]))
-			eis[i-1].skip = true;
-		t = eis[i-1];
-		eis[i-1] = eis[i];
-		eis[i] = t;
+	if (endt < begint)
+		return;
+	/* Enough windows to keep every thread busy, but none so long that the
+	 * windows in flight take up much memory. */
+	span = endt - begint + 1;
+	x.winlen = span / ((long long)nthreads * EXPAND_WINDOWS_PER_THREAD);
+	x.winlen = max(1, min(x.winlen, EXPAND_WINDOW_MAX));
+	x.nwins = (span - 1) / x.winlen + 1;
+	x.nslots = 2 * nthreads;
+	x.sched = sched;
+	x.begint = begint;
+	x.endt = endt;
+	x.fmt = fmt;
+	x.tz = tz;
+	x.next = x.emitted = 0;
+	x.wins = malloc_or_exit(x.nslots * sizeof *x.wins);
+	for (w = 0; w < x.nslots; ++w) {
+		x.wins[w].out.buf = NULL;
+		x.wins[w].out.len = x.wins[w].out.cap = 0;
+		x.wins[w].done = false;
 	}
+	pthread_mutex_init(&x.lock, NULL);
+	pthread_cond_init(&x.space, NULL);
+	pthread_cond_init(&x.done, NULL);
+
+	threads = malloc_or_exit(nthreads * sizeof *threads);
+	for (nstarted = 0; nstarted < nthreads; ++nstarted) {
+		if (pthread_create(&threads[nstarted], NULL, expand_windows, &x) != 0)
+			break;
+	}
+	if (nstarted == 0)
+		errexit("failed to create thread");
+
+	for (w = 0; w < x.nwins; ++w) {
+		win = &x.wins[w % x.nslots];
+		pthread_mutex_lock(&x.lock);
+		while (!win->done)
+			pthread_cond_wait(&x.done, &x.lock);
+		pthread_mutex_unlock(&x.lock);
+
+		out_emit(&win->out);
+		if (!win->ok) {
+			/* Keep whatever was printed before the error. */
+			out_flush();
+			errexit(win->err);
+		}
+
+		pthread_mutex_lock(&x.lock);
+		win->done = false;
+		++x.emitted;
+		pthread_cond_broadcast(&x.space);
+		pthread_mutex_unlock(&x.lock);
+	}
+
+	for (i = 0; i < nstarted; ++i)
+		pthread_join(threads[i], NULL);
+	for (w = 0; w < x.nslots; ++w)
+		free(x.wins[w].out.buf);
+	free(x.wins);
+	free(threads);
 }
 
-void
-spanarr_init(struct spanarr *arr)
+struct pipeline {
+	struct ring *rings;
+	size_t nrings;
+	struct sched *sched;
+	long long begint, endt;
+	struct fmt *fmt;
+	struct tz *tz;
+};
+
+struct producer {
+	struct pipeline *p;
+	size_t i;
+};
+
+static void *
+produce(void *arg)
+{
+	struct producer *pr;
+	struct pipeline *p;
+	struct ring *r;
+	struct cursor c;
+	struct entryiter occ;
+
+	pr = arg;
+	p = pr->p;
+	r = &p->rings[pr->i];
+	/* Entries which can duplicate each other are in the same part, so each
+	 * producer suppresses the duplicates itself. */
+	if (!cursor_openpart(&c, p->sched, p->tz, p->begint, p->endt,
+	                     pr->i, p->nrings))
+		errexit(errget());
+	/* On an error, the error itself is the last thing pushed. */
+	while (cursor_next(&c, &occ) && ring_push(r, p->fmt, p->tz, &occ))
+		;
+	cursor_close(&c);
+	atomic_store_explicit(&r->done, true, memory_order_release);
+	return NULL;
+}
+
+static int
+occ_cmp(struct occ *a, struct occ *b)
 {
-	arr->spans = NULL;
-	arr->len = 0;
-	arr->cap = 0;
+	if (a->t != b->t)
+		return a->t > b->t ? 1 : -1;
+	return a->id > b->id ? 1 : -1;
 }
 
-bool
-spanarr_insert(struct spanarr *arr, struct span span)
+/* Min-heap of rings on their next occurrences. */
+static void
+ring_siftdown(struct ring **rs, struct occ **fronts, size_t len, size_t i)
 {
-	size_t i, j;
+	size_t c;
+	struct ring *r;
+	struct occ *o;
 
-	/* Try to merge into an existing span. */
-	for (i = 0; i < arr->len; ++i) {
-		if (span_try_merge(&arr->spans[i], &span)) {
-			goto done;
+	r = rs[i];
+	o = fronts[i];
+	while ((c = 2*i + 1) < len) {
+		if (c+1 < len && occ_cmp(fronts[c+1], fronts[c]) < 0)
+			++c;
+		if (occ_cmp(o, fronts[c]) <= 0)
+			break;
+		rs[i] = rs[c];
+		fronts[i] = fronts[c];
+		i = c;
+	}
+	rs[i] = r;
+	fronts[i] = o;
+}
+
+static void
+expand_pipeline(struct sched *sched, long long begint, long long endt,
+                struct fmt *fmt, struct tz *tz, int nthreads)
+{
+	struct pipeline p;
+	struct producer *prs;
+	pthread_t *threads;
+	struct ring **rs;
+	struct occ **fronts;
+	size_t i, j, n;
+
+	p.sched = sched;
+	p.begint = begint;
+	p.endt = endt;
+	p.fmt = fmt;
+	p.tz = tz;
+	p.rings = malloc_or_exit(nthreads * sizeof *p.rings);
+	p.nrings = nthreads;
+	for (i = 0; i < (size_t)nthreads; ++i) {
+		atomic_init(&p.rings[i].head, 0);
+		atomic_init(&p.rings[i].tail, 0);
+		atomic_init(&p.rings[i].done, false);
+		for (j = 0; j < RING_LEN; ++j) {
+			p.rings[i].occs[j].out.buf = NULL;
+			p.rings[i].occs[j].out.len = p.rings[i].occs[j].out.cap = 0;
 		}
 	}
 
-	if (arr->len == arr->cap) { /* Need to grow? */
-		if (arr->cap > SIZE_MAX / 2)
-			return false; /* Overflow. */
-		arr->cap = arr->cap > 0 ? 2*arr->cap : 4;
-		arr->spans = realloc_or_exit(arr->spans, arr->cap * sizeof *arr->spans);
+	prs = malloc_or_exit(nthreads * sizeof *prs);
+	threads = malloc_or_exit(nthreads * sizeof *threads);
+	for (i = 0; i < (size_t)nthreads; ++i) {
+		prs[i].p = &p;
+		prs[i].i = i;
+		if (pthread_create(&threads[i], NULL, produce, &prs[i]) != 0)
+			errexit("failed to create thread");
 	}
 
-	i = 0;
-	while (i < arr->len && span.begin >= arr->spans[i].begin)
-		++i;
-	for (j = arr->len; j > i; --j)
-		arr->spans[j] = arr->spans[j-1];
-	arr->spans[i] = span;
-	++arr->len;
+	/* k-way merge of the rings. */
+	rs = malloc_or_exit(nthreads * sizeof *rs);
+	fronts = malloc_or_exit(nthreads * sizeof *fronts);
+	n = 0;
+	for (i = 0; i < (size_t)nthreads; ++i) {
+		if ((fronts[n] = ring_front(&p.rings[i])) != NULL)
+			rs[n++] = &p.rings[i];
+	}
+	for (i = n/2; i > 0; --i)
+		ring_siftdown(rs, fronts, n, i-1);
+	while (n > 0) {
+		if (fronts[0]->err) {
+			/* Keep whatever was printed before the error. */
+			out_flush();
+			errexit(fronts[0]->err);
+		}
+		out_emit(&fronts[0]->out);
+		ring_pop(rs[0]);
+		if ((fronts[0] = ring_front(rs[0])) == NULL) {
+			/* The ring is exhausted. */
+			--n;
+			rs[0] = rs[n];
+			fronts[0] = fronts[n];
+		}
+		ring_siftdown(rs, fronts, n, 0);
+	}
 
-done:
-	/* After adding the span, it might be possible to merge adjacent spans. */
-	i = 0;
-	for (j = 1; j < arr->len; ++j) {
-		if (!span_try_merge(&arr->spans[i], &arr->spans[j]))
-			arr->spans[++i] = arr->spans[j];
+	for (i = 0; i < (size_t)nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+		for (j = 0; j < RING_LEN; ++j)
+			free(p.rings[i].occs[j].out.buf);
 	}
-	arr->len = i+1;
+	free(p.rings);
+	free(prs);
+	free(threads);
+	free(rs);
+	free(fronts);
+}
 
-	return true;
+/* For -N, the first occurrence of every entry is looked for on a pool of
+ * threads, each taking NEXT_CHUNK entries at a time. */
+struct nextscan {
+	struct sched *sched;
+	struct tz *tz;
+	struct dtime begin;
+	long long endt;
+	struct entryiter *occs; /* By id; e == NULL => no occurrence. */
+	atomic_size_t next;     /* The first entry not yet taken. */
+};
+
+static void *
+scan_next(void *arg)
+{
+	struct nextscan *x;
+	struct entryiter *ei;
+	size_t from, to, i;
+	bool ok;
+
+	x = arg;
+	while ((from = atomic_fetch_add(&x->next, NEXT_CHUNK)) <
+	       x->sched->nentries) {
+		to = min(from + NEXT_CHUNK, x->sched->nentries);
+		for (i = from; i < to; ++i) {
+			ei = &x->occs[i];
+			ei->e = &x->sched->entries[i];
+			ok = entryiter_init(ei, &x->begin);
+			/* As with cursor_next, times which don't exist locally don't
+			 * count. */
+			while (ok && ei->t <= x->endt && tz_isgap(x->tz, ei->t))
+				ok = entryiter_next(ei);
+			if (!ok || ei->t > x->endt)
+				ei->e = NULL;
+		}
+	}
+	return NULL;
 }
 
-void
-spaniter_zero(struct spanarr *arr, Spanv *val, size_t *idx)
+static int
+next_cmp(void const *a, void const *b)
 {
-	assert(arr->len > 0);
-	*idx = 0;
-	*val = arr->spans[0].begin;
+	struct entryiter const *x, *y;
+
+	x = *(struct entryiter * const *)a;
+	y = *(struct entryiter * const *)b;
+	if (x->t != y->t)
+		return x->t > y->t ? 1 : -1;
+	return x->e->id > y->e->id ? 1 : -1;
 }
 
-bool
-spaniter_seek(struct spanarr *arr, Spanv *val, size_t *idx, Spanv target)
+/* Print the next occurrence of every event, in order, but no more than limit
+ * of them; warn about the events with no occurrence between begint and
+ * endt. */
+static void
+expand_next(struct sched *sched, long long begint, long long endt,
+            long long limit, struct fmt *fmt, struct tz *tz, int nthreads)
 {
-	size_t i;
+	struct nextscan x;
+	pthread_t *threads;
+	struct entryiter **firsts, **sorted, *ei;
+	struct entry *e;
+	char buf[256];
+	size_t i, n;
+	int nstarted;
 
-	for (i = *idx; i < arr->len; ++i) {
-		if (arr->spans[i].end >= target) {
-			*val = max(arr->spans[i].begin, target);
-			*idx = i;
-			return true;
+	x.sched = sched;
+	x.tz = tz;
+	x.endt = endt;
+	if (!min2dtime(&x.begin, begint))
+		errexit(errget());
+	x.occs = malloc_or_exit(max(sched->nentries, 1) * sizeof *x.occs);
+	atomic_init(&x.next, 0);
+	threads = malloc_or_exit(nthreads * sizeof *threads);
+	for (nstarted = 0; nstarted < nthreads - 1; ++nstarted) {
+		if (pthread_create(&threads[nstarted], NULL, scan_next, &x) != 0)
+			break;
+	}
+	/* This thread takes its share too. */
+	scan_next(&x);
+	for (i = 0; i < (size_t)nstarted; ++i)
+		pthread_join(threads[i], NULL);
+
+	/* An event's next occurrence is the first of its entries'. Ties go to
+	 * the first entry, as in the merge. */
+	firsts = malloc_or_exit(max(sched->nentries, 1) * sizeof *firsts);
+	sorted = malloc_or_exit(max(sched->nentries, 1) * sizeof *sorted);
+	for (i = 0; i < sched->nentries; ++i)
+		firsts[i] = NULL;
+	for (i = 0; i < sched->nentries; ++i) {
+		ei = &x.occs[i];
+		e = &sched->entries[i];
+		if (ei->e != NULL &&
+		    (firsts[e->dup] == NULL || ei->t < firsts[e->dup]->t))
+			firsts[e->dup] = ei;
+	}
+	n = 0;
+	for (i = 0; i < sched->nentries; ++i) {
+		if (firsts[i] != NULL)
+			sorted[n++] = firsts[i];
+	}
+	qsort(sorted, n, sizeof *sorted, next_cmp);
+	for (i = 0; i < n && limit-- > 0; ++i) {
+		if (!entryiter_printf(fmt, tz, sorted[i], 1)) {
+			out_flush();
+			errexit(errget());
+		}
+	}
+	if (!out_flush())
+		errexit(errget());
+	/* The events which don't occur again are reported apart, in input
+	 * order. */
+	for (i = 0; i < sched->nentries; ++i) {
+		e = &sched->entries[i];
+		if (e->dup == i && firsts[i] == NULL) {
+			snprintf(buf, arrlen(buf), "%.*s: event has no more occurrences",
+			         (int)min(e->textlen, 200), e->text);
+			warn(buf);
 		}
 	}
 
-	return false;
+	free(sorted);
+	free(firsts);
+	free(x.occs);
+	free(threads);
 }
 
-bool
-spaniter_next(struct spanarr *arr, Spanv *val, size_t *idx)
+/* For -a, the instants are swept in order. Each entry's iterator is kept at
+ * its first occurrence after the last instant, in a heap on those times, so
+ * that an instant only looks at the entries which begin again by it, plus
+ * those which were in progress at the instant before. */
+struct active {
+	struct entryiter ei; /* Only valid if more. */
+	bool more;
+	long long begin; /* Latest begin up to the last instant, or LLONG_MIN. */
+	size_t seen;     /* 1 + the last instant it was looked at for. */
+};
+
+/* The earliest begin of a's entry which is in progress at the time at. */
+static long long
+active_lo(struct active *a, long long at)
 {
-	assert(*idx < arr->len);
-	assert(inrange(*val, arr->spans[*idx].begin, arr->spans[*idx].end));
-	if (*val < arr->spans[*idx].end) {
-		++*val;
-	} else {
-		++*idx;
-		if (*idx >= arr->len) { /* Iter wrapped around? */
-			spaniter_zero(arr, val, idx);
-			return true;
-		} else {
-			*val = arr->spans[*idx].begin;
+	return a->ei.e->dur > 0 ? at - (a->ei.e->dur - 1) : at;
+}
+
+/* Move a->ei past the time at, keeping the latest begin up to at which exists
+ * locally in a->begin. */
+static void
+active_step(struct active *a, struct tz *tz, long long at)
+{
+	struct entryiter *ei;
+	struct dtime dt;
+	long long lo, len, last, gapbegin, gapend;
+
+	ei = &a->ei;
+	/* Nothing before lo can be in progress at at or later, so skip over
+	 * it. */
+	lo = active_lo(a, at);
+	if (ei->t < lo && (!min2dtime(&dt, lo) || !entryiter_init(ei, &dt))) {
+		a->more = false;
+		return;
+	}
+	/* A run at a time. */
+	while (ei->t <= at) {
+		len = entryiter_runlen(ei, at - ei->t + 1);
+		last = ei->t + len - 1;
+		/* The last minute of the run which exists locally. */
+		if (tz_isgap(tz, last) && tz_nextgap(tz, last, &gapbegin, &gapend))
+			last = gapbegin - 1;
+		if (last >= ei->t)
+			a->begin = last;
+		if (!(len == 1 ? entryiter_next(ei) :
+		      min2dtime(&dt, ei->t + len) && entryiter_init(ei, &dt))) {
+			a->more = false;
+			return;
 		}
 	}
-	return false;
 }
 
-bool
-span_try_merge(struct span *a, struct span *b)
+/* By begin, then input order. */
+static int
+active_cmp(void const *a, void const *b)
 {
-	if ((b->begin - a->end <= 1 && a->begin <= b->end) ||
-			(a->begin - b->end <= 1 && b->begin <= a->end)) {
-		a->begin = min(a->begin, b->begin);
-		a->end = max(a->end, b->end);
-		return true;
+	struct active const *x, *y;
+
+	x = *(struct active * const *)a;
+	y = *(struct active * const *)b;
+	if (x->begin != y->begin)
+		return x->begin > y->begin ? 1 : -1;
+	return x->ei.e->id > y->ei.e->id ? 1 : -1;
+}
+
+/* By event, then latest begin, then input order, so that the first of each
+ * event is the one which is printed. */
+static int
+active_dupcmp(void const *a, void const *b)
+{
+	struct active const *x, *y;
+
+	x = *(struct active * const *)a;
+	y = *(struct active * const *)b;
+	if (x->ei.e->dup != y->ei.e->dup)
+		return x->ei.e->dup > y->ei.e->dup ? 1 : -1;
+	if (x->begin != y->begin)
+		return x->begin < y->begin ? 1 : -1;
+	return x->ei.e->id > y->ei.e->id ? 1 : -1;
+}
+
+static int
+ll_cmp(void const *a, void const *b)
+{
+	long long x, y;
+
+	x = *(long long const *)a;
+	y = *(long long const *)b;
+	return (x > y) - (x < y);
+}
+
+/* Print the events in progress at each of the times ats[0..nats), in order
+ * of the times. For each event, only its latest occurrence in progress is
+ * printed. */
+static void
+expand_active(struct sched *sched, long long *ats, size_t nats,
+              struct fmt *fmt, struct tz *tz)
+{
+	struct active *as, *a, **live, **cands;
+	struct heapkey *heap;
+	struct entryiter occ;
+	struct dtime dt;
+	size_t nheap, nlive, ncands, i, j, n;
+	long long at;
+
+	qsort(ats, nats, sizeof *ats, ll_cmp);
+	as = malloc_or_exit(max(sched->nentries, 1) * sizeof *as);
+	heap = malloc_or_exit(max(sched->nentries, 1) * sizeof *heap);
+	live = malloc_or_exit(max(sched->nentries, 1) * sizeof *live);
+	cands = malloc_or_exit(max(sched->nentries, 1) * sizeof *cands);
+	nheap = 0;
+	for (i = 0; i < sched->nentries; ++i) {
+		a = &as[i];
+		a->ei.e = &sched->entries[i];
+		a->begin = LLONG_MIN;
+		a->seen = 0;
+		a->more = nats > 0 && min2dtime(&dt, active_lo(a, ats[0])) &&
+		          entryiter_init(&a->ei, &dt);
+		if (a->more) {
+			heap[nheap].t = a->ei.t;
+			heap[nheap++].i = i;
+		}
 	}
-	return false;
+	heap_init(heap, nheap);
+
+	nlive = 0;
+	for (j = 0; j < nats; ++j) {
+		if (j > 0 && ats[j] == ats[j-1])
+			continue;
+		at = ats[j];
+		ncands = 0;
+		while (nheap > 0 && heap[0].t <= at) {
+			a = &as[heap[0].i];
+			active_step(a, tz, at);
+			if (a->more)
+				heap[0].t = a->ei.t;
+			else
+				heap[0] = heap[--nheap];
+			if (nheap > 0)
+				heap_siftdown(heap, nheap, 0);
+			a->seen = j+1;
+			cands[ncands++] = a;
+		}
+		/* Anything else in progress at at began by the instant before, so
+		 * was in progress then too. */
+		for (i = 0; i < nlive; ++i) {
+			if (live[i]->seen != j+1) {
+				live[i]->seen = j+1;
+				cands[ncands++] = live[i];
+			}
+		}
+		nlive = 0;
+		for (i = 0; i < ncands; ++i) {
+			a = cands[i];
+			if (a->begin != LLONG_MIN && a->begin >= active_lo(a, at))
+				live[nlive++] = a;
+		}
+
+		/* Each event is in progress from the latest of its entries'
+		 * occurrences; ties go to the first entry, as in the merge. */
+		memcpy(cands, live, nlive * sizeof *live);
+		qsort(cands, nlive, sizeof *cands, active_dupcmp);
+		for (i = n = 0; i < nlive; ++i) {
+			if (n == 0 || cands[i]->ei.e->dup != cands[n-1]->ei.e->dup)
+				cands[n++] = cands[i];
+		}
+		qsort(cands, n, sizeof *cands, active_cmp);
+		for (i = 0; i < n; ++i) {
+			occ.e = cands[i]->ei.e;
+			if (!min2dtime(&dt, cands[i]->begin) ||
+			    !entryiter_init(&occ, &dt) ||
+			    !entryiter_printfat(fmt, tz, &occ, 1, at)) {
+				out_flush();
+				errexit(errget());
+			}
+		}
+	}
+	free(as);
+	free(heap);
+	free(live);
+	free(cands);
 }
 
 static void
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-f FMT]\n"
-		"       %s [-f FMT] [BEGIN] END\n"
-		"Take a description of events over standard input, and then\n"
-		"output when the events occur between BEGIN and END.\n"
-		"BEGIN defaults to now; END defaults to one day from now.\n",
-		argv0, argv0
+		"Usage: %s [-f FMT] [-i FILE]... [-j N [-p]] [-R | -r] [-n COUNT]\n"
+		"       %s [-f FMT] [-i FILE]... [-j N [-p]] [-R | -r] [-n COUNT] "
+		"[BEGIN] END\n"
+		"       %s [-i FILE]... [-j N] -C OUT\n"
+		"       %s [-i FILE]... [-j N] -X OUT [BEGIN] END\n"
+		"       %s [-f FMT] [-i FILE]... [-j N] [-n COUNT] -x INDEX [[BEGIN] END]\n"
+		"       %s [-f FMT] [-i FILE]... [-j N] [-n COUNT] -d [[BEGIN] END]\n"
+		"       %s [-f FMT] [-i FILE]... [-j N] [-n COUNT] -N [[BEGIN] END]\n"
+		"       %s [-f FMT] [-i FILE]... [-j N] -a INSTANT...\n"
+		"Take a description of events from each FILE (default: standard\n"
+		"input), and then output when the events occur between BEGIN and END.\n"
+		"BEGIN defaults to now; END defaults to one day from now.\n"
+		"With -R, print each run of an event at consecutive minutes once.\n"
+		"With -r, print them backwards from END; BEGIN then defaults to one\n"
+		"day before now, and END to now.\n"
+		"With -n, stop after COUNT occurrences; END (or with -r, BEGIN) is\n"
+		"then unbounded by default, and a lone argument is BEGIN (or with -r,\n"
+		"END).\n"
+		"With -C, write the events to OUT as a compiled schedule instead.\n"
+		"With -X, write the occurrences to OUT as an index instead, which\n"
+		"-x then looks them up in (with -n, END defaults to the end of\n"
+		"INDEX).\n"
+		"With -d, print each occurrence as it begins, until END (default:\n"
+		"forever), rereading each FILE on SIGHUP.\n"
+		"With -N, print the next occurrence of each event, in order, and\n"
+		"warn about those with none before END (default: never).\n"
+		"With -a, print the events in progress at each INSTANT.\n",
+		argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0
 	);
 	exit(EXIT_FAILURE);
 }
 
+static bool
+load(struct sched *sched, char **inputs, size_t ninputs, int nthreads)
+{
+	size_t i;
+
+	if (!sched_init(sched))
+		return false;
+	sched->warn = warn;
+	for (i = 0; i < ninputs; ++i) {
+		if (!sched_load(sched, inputs[i], nthreads)) {
+			sched_free(sched);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Print the occurrences between begint and endt (but no more than limit of
+ * them) from the index at path, rather than from the schedule itself.
+ * endt == LLONG_MAX => the end of the index. */
+static void
+expand_index(char **inputs, size_t ninputs, int nthreads, long long begint,
+             long long endt, long long limit, struct fmt *fmt, struct tz *tz,
+             char const *path)
+{
+	struct sched sched;
+	struct index ix;
+	struct entryiter occ;
+	size_t i;
+	bool loaded;
+
+	/* If the inputs haven't changed, they needn't be read at all, so a
+	 * query costs about a binary search and the records printed. Otherwise,
+	 * they are loaded, and must give the same entries as before. */
+	loaded = false;
+	if (!index_openinputs(&ix, tz, path, inputs, ninputs)) {
+		if (!load(&sched, inputs, ninputs, nthreads) ||
+		    !index_open(&ix, &sched, tz, path))
+			errexit(errget());
+		loaded = true;
+	}
+	/* With -n and no END, go as far as the index does. */
+	if (endt == LLONG_MAX)
+		endt = ix.h.endt;
+	if (begint < ix.h.begint || endt > ix.h.endt) {
+		errset("range not covered by the index");
+		erradd(path);
+		errexit(errget());
+	}
+	for (i = index_seek(&ix, begint);
+	     i < ix.h.nrecs && ix.recs[i].begin <= endt && limit-- > 0; ++i) {
+		if (!index_get(&ix, i, &occ) || !entryiter_printf(fmt, tz, &occ, 1)) {
+			out_flush();
+			errexit(errget());
+		}
+	}
+	index_close(&ix);
+	if (loaded)
+		sched_free(&sched);
+}
+
+/* SIGHUP is blocked in every thread but hupwaiter, which passes it on
+ * through hup, so that the daemon can wait for either it or the next
+ * occurrence without a window in which it is missed. */
+static pthread_mutex_t huplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hupcond = PTHREAD_COND_INITIALIZER;
+static bool hup;
+
+static void *
+hupwaiter(void *arg)
+{
+	sigset_t hupset;
+	int sig;
+
+	(void)arg;
+	sigemptyset(&hupset);
+	sigaddset(&hupset, SIGHUP);
+	for (;;) {
+		if (sigwait(&hupset, &sig) != 0)
+			continue;
+		pthread_mutex_lock(&huplock);
+		hup = true;
+		pthread_cond_signal(&hupcond);
+		pthread_mutex_unlock(&huplock);
+	}
+	return NULL;
+}
+
+/* Wait until the Unix time deadline (NULL => forever) or a SIGHUP, whichever
+ * comes first. Return whether a SIGHUP came, and forget it. */
+static bool
+waithup(struct timespec *deadline)
+{
+	bool got;
+	int err;
+
+	pthread_mutex_lock(&huplock);
+	err = 0;
+	while (!hup && err != ETIMEDOUT) {
+		if (deadline != NULL)
+			err = pthread_cond_timedwait(&hupcond, &huplock, deadline);
+		else
+			err = pthread_cond_wait(&hupcond, &huplock);
+		if (err != 0 && err != ETIMEDOUT)
+			errexit(strerror(err));
+	}
+	got = hup;
+	hup = false;
+	pthread_mutex_unlock(&huplock);
+	return got;
+}
+
+/* The current minute, as parse_instant takes it. */
+static bool
+nowmin(long long *t)
+{
+	char s[] = "/";
+	struct dtime dt;
+
+	if (!parse_instant(&dt, s) || !dtime2min(t, &dt)) {
+		erradd("failed to get the current time");
+		return false;
+	}
+	return true;
+}
+
+/* Print each occurrence from begint to endt (but no more than limit of them)
+ * when it begins, sleeping in between. On SIGHUP, the inputs are loaded
+ * again, and the new schedule takes over from now, or from just after the
+ * last occurrence printed if that is later. */
+static void
+run_daemon(char **inputs, size_t ninputs, int nthreads, long long begint,
+           long long endt, long long limit, struct fmt *fmt, struct tz *tz)
+{
+	sigset_t hupset;
+	pthread_t waiter;
+	struct sched sched, next;
+	struct cursor c;
+	struct entryiter occ;
+	struct timespec ts;
+	bool have, reload;
+	long long printed, from;
+	int err;
+
+	/* Before any thread is started, so that they all inherit the mask. */
+	sigemptyset(&hupset);
+	sigaddset(&hupset, SIGHUP);
+	if ((err = pthread_sigmask(SIG_BLOCK, &hupset, NULL)) != 0)
+		errexit(strerror(err));
+	if (pthread_create(&waiter, NULL, hupwaiter, NULL) != 0)
+		errexit("failed to create thread");
+
+	if (!load(&sched, inputs, ninputs, nthreads) ||
+	    !cursor_open(&c, &sched, tz, begint, endt))
+		errexit(errget());
+	printed = LLONG_MIN;
+	for (;;) {
+		have = cursor_next(&c, &occ);
+		/* Simultaneous occurrences are printed together, so the schedule is
+		 * only swapped between them. */
+		if (have && occ.t == printed)
+			goto print;
+		if (!out_flush())
+			errexit(errget());
+		if (have) {
+			ts.tv_sec = tz_unix(tz, occ.t);
+			ts.tv_nsec = 0;
+			reload = waithup(&ts);
+		} else if (endt == LLONG_MAX) {
+			/* Nothing more will happen unless the inputs change. */
+			reload = waithup(NULL);
+		} else {
+			break;
+		}
+		if (reload) {
+			if (!load(&next, inputs, ninputs, nthreads)) {
+				erradd("reload failed");
+				warn(errget());
+			} else {
+				cursor_close(&c);
+				sched_free(&sched);
+				sched = next;
+				/* Not from occ, which is only the old schedule's next
+				 * occurrence: the new one may have others before it. Nor
+				 * from before now, which would print them late. */
+				if (!nowmin(&from))
+					errexit(errget());
+				from = max(from, max(printed+1, begint));
+				if (!cursor_open(&c, &sched, tz, from, endt))
+					errexit(errget());
+			}
+			continue;
+		}
+print:
+		if (!entryiter_printf(fmt, tz, &occ, 1)) {
+			out_flush();
+			errexit(errget());
+		}
+		printed = occ.t;
+		if (--limit == 0)
+			break;
+	}
+	if (!out_flush())
+		errexit(errget());
+	cursor_close(&c);
+	sched_free(&sched);
+	pthread_cancel(waiter);
+	pthread_join(waiter, NULL);
+}
+
 int
 main(int argc, char **argv)
 {
-	char *fmt;
+	char *fmtstr;
+	struct fmt fmt;
 	char *beginstr, *endstr;
-	struct dtime begin, end;
-	struct entry *entry, *e;
-	size_t nentries;
-	size_t i;
-	struct entryiter *eis;
+	struct dtime begin, end, at;
+	char **inputs, **atstrs;
+	size_t ninputs, nats, i;
+	char *s, *jstr, *nstr, *outpath, *indexout, *indexpath;
+	Spanv nthreads, count;
+	bool pipeline, rundaemon, hasbegin, hasend, runs, haslimit, nexts, rev;
+	struct sched sched;
+	struct cursor c;
+	struct entryiter occ;
+	long long begint, endt, n, limit, *ats;
+	struct tz tz;
 
-	fmt = DFLT_FMT;
+	fmtstr = NULL;
+	inputs = malloc_or_exit(argc * sizeof *inputs);
+	ninputs = 0;
+	atstrs = malloc_or_exit(argc * sizeof *atstrs);
+	nats = 0;
+	nthreads = 1;
+	pipeline = rundaemon = runs = haslimit = nexts = rev = false;
+	ats = NULL;
+	limit = LLONG_MAX;
+	outpath = indexout = indexpath = NULL;
 
-	/* TODO -i INPUT_FIE option? */
 	ARGBEGIN {
 	case 'f':
-		fmt = EARGF(usage());
+		fmtstr = EARGF(usage());
+		break;
+	case 'i':
+		inputs[ninputs++] = EARGF(usage());
+		break;
+	case 'p':
+		pipeline = true;
+		break;
+	case 'C':
+		outpath = EARGF(usage());
+		break;
+	case 'X':
+		indexout = EARGF(usage());
+		break;
+	case 'x':
+		indexpath = EARGF(usage());
+		break;
+	case 'd':
+		rundaemon = true;
+		break;
+	case 'R':
+		runs = true;
+		break;
+	case 'N':
+		nexts = true;
+		break;
+	case 'a':
+		atstrs[nats++] = EARGF(usage());
+		break;
+	case 'r':
+		rev = true;
+		break;
+	case 'n':
+		s = nstr = EARGF(usage());
+		if (!parse_num(&count, &s) || *s != '\0' || count == 0) {
+			fprintf(stderr, "invalid count '%s'\n", nstr);
+			usage();
+		}
+		haslimit = true;
+		limit = count;
+		break;
+	case 'j':
+		s = jstr = EARGF(usage());
+		if (!parse_num(&nthreads, &s) || *s != '\0' || nthreads == 0) {
+			fprintf(stderr, "invalid thread count '%s'\n", jstr);
+			usage();
+		}
 		break;
 	case 'h':
 		usage();
@@ -294,8 +1059,56 @@ main(int argc, char **argv)
 		usage();
 	} ARGEND
 
-	beginstr = DFLT_BEGIN;
-	endstr = DFLT_END;
+	if ((outpath != NULL) + (indexout != NULL) + (indexpath != NULL) +
+	    rundaemon + nexts + (nats > 0) > 1) {
+		fprintf(stderr, "-C, -X, -x, -d, -N, and -a are exclusive\n");
+		usage();
+	}
+	if (runs && (outpath != NULL || indexout != NULL || indexpath != NULL ||
+	    rundaemon || nexts || nats > 0)) {
+		fprintf(stderr, "-R can't be used with -C, -X, -x, -d, -N, or -a\n");
+		usage();
+	}
+	if (rev && (outpath != NULL || indexout != NULL || indexpath != NULL ||
+	    rundaemon || nexts || nats > 0 || runs)) {
+		fprintf(stderr, "-r can't be used with -C, -X, -x, -d, -N, -a, or -R\n");
+		usage();
+	}
+	if (haslimit && (outpath != NULL || indexout != NULL || nats > 0)) {
+		fprintf(stderr, "-n can't be used with -C, -X, or -a\n");
+		usage();
+	}
+	if (fmtstr == NULL)
+		fmtstr = runs ? DFLT_RUNFMT : nats > 0 ? DFLT_ACTIVEFMT : DFLT_FMT;
+	if (ninputs == 0)
+		inputs[ninputs++] = NULL; /* Standard input. */
+	if (outpath != NULL) {
+		if (*argv != NULL) {
+			fprintf(stderr, "too many arguments\n");
+			usage();
+		}
+		if (!load(&sched, inputs, ninputs, nthreads) ||
+		    !sched_save(&sched, outpath))
+			errexit(errget());
+		return 0;
+	}
+
+	if (nats > 0 && *argv != NULL) {
+		fprintf(stderr, "too many arguments\n");
+		usage();
+	}
+	beginstr = rev ? DFLT_REVBEGIN : DFLT_BEGIN;
+	endstr = rev ? DFLT_REVEND : DFLT_END;
+	hasend = *argv != NULL;
+	hasbegin = hasend && argv[1] != NULL;
+	/* With -n, a lone argument is where to start from, and the other end is
+	 * left unbounded. */
+	if (haslimit && !rev && *argv != NULL && argv[1] == NULL) {
+		beginstr = *argv;
+		argv++;
+		hasbegin = true;
+		hasend = false;
+	}
 	if (*argv != NULL) {
 		endstr = *argv;
 		argv++;
@@ -310,47 +1123,106 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	if (!parse_instant(&begin, beginstr)) {
+	if (!parse_instant(&begin, beginstr) || !dtime2min(&begint, &begin)) {
 		erradd("failed to parse begin time");
 		errexit(errget());
 	}
-	if (!parse_instant(&end, endstr)) {
+	if (!parse_instant(&end, endstr) || !dtime2min(&endt, &end)) {
 		erradd("failed to parse end time");
 		errexit(errget());
 	}
+	if ((rundaemon || haslimit || nexts) && !rev && !hasend)
+		endt = LLONG_MAX;
+	/* Backwards, it is BEGIN that goes unbounded. */
+	if (haslimit && rev && !hasbegin)
+		begint = LLONG_MIN;
+	if (nats > 0) {
+		/* The time zone is wanted from the first instant to the last. */
+		ats = malloc_or_exit(nats * sizeof *ats);
+		for (i = 0; i < nats; ++i) {
+			if (!parse_instant(&at, atstrs[i]) || !dtime2min(&ats[i], &at)) {
+				erradd("failed to parse instant");
+				errexit(errget());
+			}
+			if (i == 0 || ats[i] < begint) {
+				begin = at;
+				begint = ats[i];
+			}
+			if (i == 0 || ats[i] > endt) {
+				end = at;
+				endt = ats[i];
+			}
+		}
+	}
 
-	if (!parse_entries(&entry, &nentries))
+	if (!fmt_compile(&fmt, fmtstr))
+		errexit(errget());
+	/* An end left unbounded keeps its default, which may be before BEGIN. */
+	if (!tz_load(&tz, min(begin.year, end.year),
+	             max(begin.year, end.year))) {
+		erradd("failed to load time zone");
 		errexit(errget());
-	eis = malloc_or_exit(nentries * sizeof *eis);
-	i = 0;
-	for (e = entry; e; e = e->next) {
-		eis[i].e = e;
-		if (entryiter_init(&eis[i], &begin))
-			++i;
-		else
-			--nentries;
 	}
-	entryiter_sort(eis, nentries);
 
-	i = 0;
-	while (i < nentries) {
-		if (dtime_cmp(&eis[i].dt, &end) > 0) {
-			/* The iterator is exhausted. */
-			++i;
-			continue;
+	if (rundaemon) {
+		run_daemon(inputs, ninputs, nthreads, begint, endt, limit, &fmt, &tz);
+		return 0;
+	}
+	/* With -x, the index decides whether the events need loading. */
+	if (indexpath == NULL && !load(&sched, inputs, ninputs, nthreads))
+		errexit(errget());
+	if (indexout != NULL) {
+		if (!sched_index(&sched, &tz, begint, endt, indexout))
+			errexit(errget());
+	} else if (indexpath != NULL) {
+		expand_index(inputs, ninputs, nthreads, begint, endt, limit, &fmt,
+		             &tz, indexpath);
+	} else if (nexts) {
+		expand_next(&sched, begint, endt, limit, &fmt, &tz, nthreads);
+	} else if (nats > 0) {
+		expand_active(&sched, ats, nats, &fmt, &tz);
+	} else if (runs) {
+		/* A window or a part of the events would cut runs short, so only
+		 * the parsing is done in parallel. */
+		if (!cursor_open(&c, &sched, &tz, begint, endt))
+			errexit(errget());
+		while (limit-- > 0 && cursor_nextrun(&c, &occ, &n)) {
+			if (!entryiter_printf(&fmt, &tz, &occ, n)) {
+				out_flush();
+				errexit(errget());
+			}
 		}
-		if (!eis[i].skip) {
-			if (!entryiter_printf(fmt, &eis[i]))
+	} else if (rev) {
+		/* Backwards, the merge is as lazy as forwards, so -n costs about
+		 * COUNT steps however far back BEGIN is. */
+		if (!cursor_openrev(&c, &sched, &tz, begint, endt))
+			errexit(errget());
+		while (limit-- > 0 && cursor_next(&c, &occ)) {
+			if (!entryiter_printf(&fmt, &tz, &occ, 1)) {
+				out_flush();
 				errexit(errget());
-		} else {
-			eis[i].skip = false;
+			}
+		}
+	} else if (nthreads > 1 && pipeline && !haslimit) {
+		expand_pipeline(&sched, begint, endt, &fmt, &tz, nthreads);
+	} else if (nthreads > 1 && !haslimit) {
+		expand_parallel(&sched, begint, endt, &fmt, &tz, nthreads);
+	} else {
+		/* The merge is lazy, so with -n, only the first occurrence of each
+		 * event and then about COUNT more are ever worked out, however far
+		 * off END is. */
+		if (!cursor_open(&c, &sched, &tz, begint, endt))
+			errexit(errget());
+		while (limit-- > 0 && cursor_next(&c, &occ)) {
+			if (!entryiter_printf(&fmt, &tz, &occ, 1)) {
+				/* Keep whatever was printed before the error. */
+				out_flush();
+				errexit(errget());
+			}
 		}
-		if (!entryiter_next(&eis[i]))
-			/* The iterator is exhausted. */
-			++i;
-		else
-			entryiter_resort(&eis[i], nentries-i);
 	}
 
+	if (!out_flush())
+		errexit(errget());
 	return 0;
 }
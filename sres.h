@@ -1,4 +1,7 @@
-/* Requires: limits.h, stdbool.h, time.h */
+/* Internals of libsres and sres, on top of its public interface. */
+/* Requires: limits.h, pthread.h, stdbool.h, stdint.h, time.h */
+
+#include "libsres.h"
 
 #define max(a,b) ((a) > (b) ? (a) : (b))
 #define min(a,b) ((a) < (b) ? (a) : (b))
@@ -6,79 +9,140 @@
 #define inrange(a,l,u) ((l) <= (a) && (a) <= (u))
 #define arrlen(a) (sizeof (a) / sizeof (a)[0])
 
+/* Index of the lowest set bit; x must be nonzero. */
+#define ctz64(x) __builtin_ctzll(x)
+/* Index of the highest set bit; x must be nonzero. */
+#define top64(x) (63 - __builtin_clzll(x))
+
 /* Helper for filling the first 3 args of spaniter_XXX functions. */
 #define spaniter(ei, t) &ei->e->t, &ei->dt.t, &ei->t##i
+/* Helper for filling the first 2 args of bititer_XXX functions. */
+#define bititer(ei, t) ei->e->t, &ei->dt.t
+
+#define OUTBUF_LEN (1 << 16)
+/* Inputs are only split for parallel parsing into chunks at least this big. */
+#define PARSE_CHUNK_MIN (1 << 16)
+/* For parallel expansion, [BEGIN, END] is cut into about this many windows
+ * per thread, each at most EXPAND_WINDOW_MAX minutes (4 weeks) long. */
+#define EXPAND_WINDOWS_PER_THREAD 8
+#define EXPAND_WINDOW_MAX (28LL * 1440LL)
+/* Occurrences buffered per producer thread with -p. */
+#define RING_LEN 1024
+/* Entries taken at a time by each thread looking for next occurrences with
+ * -N. */
+#define NEXT_CHUNK 256
+/* Each entry is checked against at most this many earlier entries like it
+ * when looking for redundant ones (see sched_dedup). */
+#define PRUNE_SCAN 16
+/* Size of the blocks carved up by arena_alloc. */
+#define ARENA_BLOCK (1 << 16)
+
+/* Identifies a compiled schedule (see sched_save). The version changes
+ * whenever the layout does; the byte order is written natively, to catch
+ * files from machines of the other order. */
+#define SRESC_MAGIC "sresc\n\0\0"
+#define SRESC_VERSION 1
+#define SRESC_BYTEORDER 0x01020304
+/* Ditto for an occurrence index (see sched_index). */
+#define SRESX_MAGIC "sresx\n\0\0"
+#define SRESX_VERSION 2
+
+/* A format string (see -f) compiled by fmt_compile. */
+enum fmtoptype {
+	FMTOP_LIT,   /* Copy lit[0..litlen). */
+	FMTOP_TEXT,  /* %x */
+	FMTOP_DUR,   /* %d */
+	FMTOP_BEGIN, /* %b_ */
+	FMTOP_END,   /* %e_ */
+	FMTOP_LAST,  /* %l_ */
+	FMTOP_AT,    /* %a_ */
+	FMTOP_COUNT, /* %c */
+};
 
-#define SPANV_MAX INT_MAX
-#define SPANV_MIN INT_MIN
-#define YEAR_MAX SPANV_MAX
-#define YEAR_MIN SPANV_MIN
-
-enum dow {
-	SUN, MON, TUE, WED, THU, FRI, SAT
+struct fmtop {
+	enum fmtoptype type;
+	char const *lit;
+	size_t litlen;
+	unsigned int flags; /* For the time conversions (%b_, %e_, %l_, %a_). */
+	char conv;          /* Ditto. */
 };
 
-enum month {
-	JAN, FEB, MAR, APR, MAY, JUN,
-	JUL, AUG, SEP, OCT, NOV, DEC
+/* The layout of a compiled schedule. Offsets are in bytes from the start of
+ * the file; span and text are indexes into the spans and texts. */
+struct sresc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t nentries, nspans, textlen;
+	uint64_t entryoff, spanoff, textoff;
 };
 
-/* Spanv is the type used to represent minutes, hours, dow, dom, months,
- * and years. Using a bigger type will allow representing a wider range
- * of years. Keep in sync with SPANV_MAX and SPANV_MIN. */
-/* TODO rename this */
-typedef int Spanv;
-
-/* Basically struct tm. */
-struct dtime {
-	Spanv min;  /* 0-59 */
-	Spanv hour; /* 0-23 */
-	Spanv dow;  /* 0-6, <0 => unknown */
-	Spanv dom;  /* 0-30 */
-	Spanv mon;  /* 0-11 */
-	Spanv year; /* ..., -1 == 2BC, 0 == 1BC, 1 == 1AD, 2 == 2AD, ... */
+struct sresc_entry {
+	uint64_t min;
+	uint32_t hour, dow, dom, mon;
+	int64_t dur;
+	uint64_t span, nspans;
+	uint64_t text, textlen;
 };
 
-struct span {
-	Spanv begin;
-	Spanv end;
+/* What an occurrence index keeps of an entry: just what is printed. */
+struct sresx_entry {
+	int64_t dur;
+	uint64_t text, textlen;
 };
 
-struct spanarr {
-	struct span *spans;
+/* A growable buffer, which output can be captured into (see out_capture). */
+struct strbuf {
+	char *buf;
 	size_t len;
 	size_t cap;
 };
 
-struct entry {
-	char *text;
-	struct spanarr min, hour, dow, dom, mon, year;
-	long dur;
-	struct entry *next;
-};
-
-struct entryiter {
-	struct entry *e;
-	struct dtime dt;
-	size_t mini, houri, domi, moni, yeari;
-	bool dow[7];
-	bool skip; /* Set when two or more iters refer to the same event. */
+struct fmt {
+	struct fmtop *ops;
+	size_t len;
+	bool needend;  /* Has a %e_ conversion. */
+	bool needlast; /* Has a %l_ conversion. */
+	bool needat;   /* Has a %a_ conversion. */
+	bool needu;    /* Has a %bu, %eu, %lu, or %au conversion. */
 };
 
-/* sres.c */
+/* sched.c */
 void entry_init(struct entry *e);
+bool entry_occurs(struct entry *e);
 bool entryiter_init(struct entryiter *ei, struct dtime *begin);
 bool entryiter_next(struct entryiter *ei);
-bool entryiter_stabilizedmy(struct entryiter *ei);
-bool entryiter_eq(struct entryiter *a, struct entryiter *b);
-void entryiter_sort(struct entryiter *eis, size_t len);
-void entryiter_resort(struct entryiter *eis, size_t len);
+long long entryiter_runlen(struct entryiter *ei, long long max);
+bool entryiter_seekday(struct entryiter *ei, int doy);
+bool entryiter_seekyear(struct entryiter *ei, Spanv year);
+bool entryiter_initrev(struct entryiter *ei, struct dtime *end);
+bool entryiter_prev(struct entryiter *ei);
+bool entryiter_seekdayrev(struct entryiter *ei, int doy);
+bool entryiter_seekyearrev(struct entryiter *ei, Spanv year);
+void heap_init(struct heapkey *heap, size_t len);
+void heap_siftdown(struct heapkey *heap, size_t len, size_t i);
 void spanarr_init(struct spanarr *arr);
-bool spanarr_insert(struct spanarr *arr, struct span span);
+bool spanarr_append(struct spanarr *arr, struct span span);
+void spanarr_coalesce(struct spanarr *arr);
 void spaniter_zero(struct spanarr *arr, Spanv *val, size_t *idx);
 bool spaniter_seek(struct spanarr *arr, Spanv *val, size_t *idx, Spanv target);
 bool spaniter_next(struct spanarr *arr, Spanv *val, size_t *idx);
+void spaniter_last(struct spanarr *arr, Spanv *val, size_t *idx);
+bool spaniter_seekrev(struct spanarr *arr, Spanv *val, size_t *idx,
+                      Spanv target);
 bool span_try_merge(struct span *a, struct span *b);
+void bititer_zero(uint64_t mask, Spanv *val);
+bool bititer_seek(uint64_t mask, Spanv *val, Spanv target);
+bool bititer_next(uint64_t mask, Spanv *val);
+void bititer_last(uint64_t mask, Spanv *val);
+bool bititer_seekrev(uint64_t mask, Spanv *val, Spanv target);
+bool bititer_prev(uint64_t mask, Spanv *val);
+bool bits_seek(uint64_t const *bits, int nbits, int *i);
+bool bits_seekrev(uint64_t const *bits, int nbits, int *i);
+int bits_run(uint64_t const *bits, int nbits, int i);
+struct daytab *daytab_get(struct sched *s, uint32_t dow, uint32_t dom,
+                          uint32_t mon);
+bool sched_dedup(struct sched *s, size_t from);
 
 /* parse.c */
 char *nexttok(char **s, char delim);
@@ -95,27 +159,55 @@ bool parse_span(struct span *span, char *s, bool (*str2num)(Spanv*, char**));
 bool parse_spanarr(struct spanarr *arr, char *s,
                    bool (*str2num)(Spanv*, char**),
                    Spanv min, Spanv max);
+bool parse_bitmask(uint64_t *mask, char *s,
+                   bool (*str2num)(Spanv*, char**),
+                   Spanv min, Spanv max);
 bool parse_duration(long *dur, char **s);
-bool parse_entries(struct entry **entry, size_t *n);
-bool parse_instant(struct dtime *dt, char *s);
+bool parse_entries(struct sched *s, struct input *in, int nthreads);
+
+/* sres.c */
+void *malloc_or_exit(size_t n);
+void *realloc_or_exit(void *ptr, size_t n);
+void errexit(char const *msg);
+void warn(char const *msg);
+
+/* compile.c */
+bool sresc_is(struct input *in);
+bool sresc_load(struct sched *s, struct input *in);
 
 /* output.c */
-bool entryiter_printf(char *fmt, struct entryiter *ei);
+bool fmt_compile(struct fmt *f, char *s);
+bool entryiter_printf(struct fmt *f, struct tz *tz, struct entryiter *ei,
+                      long long n);
+bool entryiter_printfat(struct fmt *f, struct tz *tz, struct entryiter *ei,
+                        long long n, long long at);
+bool out_flush(void);
+void out_capture(struct strbuf *sb);
+void out_emit(struct strbuf *sb);
 
 /* time.c */
 bool dtime_isdmyvalid(struct dtime *dt);
-bool dtime_calcdow(struct dtime *dt);
 int dtime2doy(struct dtime *dt);
-int dtime_cmp(struct dtime *a, struct dtime *b);
-bool dtime2tm(struct tm *tm, struct dtime *dt);
-bool dtime2min(long long *min, struct dtime *dt);
-bool min2dtime(struct dtime *dt, long long min);
+void dtime_setdoy(struct dtime *dt, int doy);
+int yeartype(Spanv year);
+void daytab_fill(struct daytab *tab, uint32_t dow, uint32_t dom, uint32_t mon);
+bool daytab_seekyear(struct daytab *tab, Spanv *year);
+bool daytab_seekyearrev(struct daytab *tab, Spanv *year);
+long long yearmin(Spanv year);
 bool dtime_add(struct dtime *dt, long mins);
 
+/* tz.c */
+bool tz_isgap(struct tz *tz, long long min);
+bool tz_nextgap(struct tz *tz, long long min, long long *gapbegin,
+                long long *gapend);
+
 /* util.c */
-void *malloc_or_exit(size_t n);
-void *realloc_or_exit(void *ptr, size_t n);
-void errexit(char const *msg);
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t n);
+void arena_splice(struct arena *dst, struct arena *src);
+void arena_free(struct arena *a);
+bool input_open(struct input *in, char const *path);
+bool input_stamp(struct inputstamp *st, char const *path);
+void input_close(struct input *in);
 void errset(char const *s);
 void erradd(char const *s);
-char *errget(void);
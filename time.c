@@ -1,5 +1,7 @@
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "sres.h"
@@ -9,9 +11,9 @@
 #define DAYS4Y   (  3LL*365LL +  1LL*366LL)
 
 #define is_leap_year(y) ((y%4 == 0 && y%100 != 0) || y%400 == 0)
+/* y mod 400 in 0-399, even for negative y. */
+#define cycleyear(y) (((y)%400 + 400) % 400)
 
-static int jan1dow[400];
-static bool jan1dow_inited = false;
 static int monthdayscommon[12] = {
 	31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
 };
@@ -33,22 +35,17 @@ static int daysbeforemonth[12] = {
 	31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31 + 30,
 };
 
-static void
-init_jan1dow(void)
+/* The day of the week of 1 January of year y. Jan 1, 1 BC is a Saturday in
+ * the proleptic Gregorian calendar, and every year moves it on by 1 day (365
+ * mod 7), plus 1 for a leap year. This is computed rather than looked up in
+ * a table so that there is no global state to initialize. */
+static int
+jan1dow(Spanv y)
 {
-	int year, day;
-
-	if (jan1dow_inited)
-		return;
-	jan1dow_inited = true;
-
-	year = 0;
-	/* Jan 1, 1 BC is a Saturday in the proleptic Gregorian calendar. */
-	day = SAT;
-	for (; year < 400; ++year) {
-		jan1dow[year] = day % 7;
-		day += 1 + is_leap_year(year);
-	}
+	int c;
+
+	c = cycleyear(y);
+	return (SAT + c + (c+3)/4 - (c+99)/100 + (c+399)/400) % 7;
 }
 
 bool
@@ -65,58 +62,144 @@ dtime_calcdow(struct dtime *dt)
 {
 	int doy;
 
-	init_jan1dow();
 	if ((doy = dtime2doy(dt)) < 0)
 		return false;
-	dt->dow = (jan1dow[dt->year%400] + doy) % 7;
+	dt->dow = (jan1dow(dt->year) + doy) % 7;
 	return true;
 }
 
 int
-dtime2doy(struct dtime *dt)
+yeartype(Spanv year)
 {
-	if (!dtime_isdmyvalid(dt))
-		return -1;
-	return daysbeforemonth[dt->mon] + dt->dom +
-		(dt->mon > FEB && is_leap_year(dt->year));
+	return jan1dow(year) + 7*is_leap_year(year);
 }
 
-int
-dtime_cmp(struct dtime *a, struct dtime *b)
+void
+dtime_setdoy(struct dtime *dt, int doy)
 {
-	/* Could probably do this branchlessly, but need to be wary of overflow. */
-	if (a->year != b->year) return a->year > b->year ? 1 : -1;
-	if (a->mon  != b->mon)  return a->mon  > b->mon  ? 1 : -1;
-	if (a->dom  != b->dom)  return a->dom  > b->dom  ? 1 : -1;
-	if (a->hour != b->hour) return a->hour > b->hour ? 1 : -1;
-	if (a->min  != b->min)  return a->min  > b->min  ? 1 : -1;
-	return 0;
+	int *monthdays;
+
+	monthdays = is_leap_year(dt->year) ? monthdaysleap : monthdayscommon;
+	dt->dow = (jan1dow(dt->year) + doy) % 7;
+	for (dt->mon = JAN; doy >= monthdays[dt->mon]; ++dt->mon)
+		doy -= monthdays[dt->mon];
+	dt->dom = doy;
+}
+
+void
+daytab_fill(struct daytab *tab, uint32_t dow, uint32_t dom, uint32_t mon)
+{
+	int t, w, doy;
+	int jan1, leap;
+	struct dtime dt;
+
+	tab->dow = dow;
+	tab->dom = dom;
+	tab->mon = mon;
+	for (t = 0; t < NYEARTYPES; ++t) {
+		for (w = 0; w < DAYWORDS; ++w)
+			tab->days[t][w] = 0;
+		jan1 = t % 7;
+		leap = t / 7;
+		/* Any year of the right leapness gives the right mon and dom for each
+		 * doy; the dow comes from jan1 instead. */
+		dt.year = leap ? 2000 : 2001;
+		for (doy = 0; doy < 365 + leap; ++doy) {
+			dtime_setdoy(&dt, doy);
+			if ((dow >> (jan1 + doy) % 7 & 1) &&
+			    (dom >> dt.dom & 1) && (mon >> dt.mon & 1))
+				tab->days[t][doy/64] |= UINT64_C(1) << doy%64;
+		}
+	}
+
+	for (w = 0; w < CYCLEWORDS; ++w)
+		tab->years[w] = 0;
+	for (t = 0; t < CYCLEYEARS; ++t) {
+		doy = 0;
+		if (bits_seek(tab->days[yeartype(t)], DAYBITS, &doy))
+			tab->years[t/64] |= UINT64_C(1) << t%64;
+	}
 }
 
 bool
-dtime2tm(struct tm *tm, struct dtime *dt)
+daytab_seekyear(struct daytab *tab, Spanv *year)
 {
-	if (dt->year < INT_MIN + 1900 || dt->year - 1900 > INT_MAX) {
-		errset("dtime year overflows tm year");
+	int from, i;
+	long long y;
+
+	from = i = cycleyear(*year);
+	if (bits_seek(tab->years, CYCLEYEARS, &i)) {
+		y = (long long) *year + (i - from);
+	} else {
+		/* Wrap around to the next cycle. */
+		i = 0;
+		if (!bits_seek(tab->years, CYCLEYEARS, &i))
+			return false; /* No year ever has a permitted day. */
+		y = (long long) *year + (CYCLEYEARS - from) + i;
+	}
+	if (y > YEAR_MAX)
 		return false;
+	*year = y;
+	return true;
+}
+
+/* Like daytab_seekyear, but for the last such year <= *year. */
+bool
+daytab_seekyearrev(struct daytab *tab, Spanv *year)
+{
+	int from, i;
+	long long y;
+
+	from = i = cycleyear(*year);
+	if (bits_seekrev(tab->years, CYCLEYEARS, &i)) {
+		y = (long long) *year - (from - i);
+	} else {
+		/* Wrap around to the previous cycle. */
+		i = CYCLEYEARS - 1;
+		if (!bits_seekrev(tab->years, CYCLEYEARS, &i))
+			return false;
+		y = (long long) *year - from - (CYCLEYEARS - i);
 	}
-	tm->tm_year  = dt->year - 1900;
-	tm->tm_mon   = dt->mon;
-	tm->tm_mday  = dt->dom + 1;
-	tm->tm_wday  = dt->dow;
-	tm->tm_hour  = dt->hour;
-	tm->tm_min   = dt->min;
-	tm->tm_sec   = 0;
-	tm->tm_isdst = -1;
+	if (y < YEAR_MIN)
+		return false;
+	*year = y;
 	return true;
 }
 
+int
+dtime2doy(struct dtime *dt)
+{
+	if (!dtime_isdmyvalid(dt))
+		return -1;
+	return daysbeforemonth[dt->mon] + dt->dom +
+		(dt->mon > FEB && is_leap_year(dt->year));
+}
+
+/* Minutes from 1 Jan 1BC to 00:00 1 Jan of year (see dtime2min). */
+long long
+yearmin(Spanv year)
+{
+	long long min, y;
+
+	min = 0;
+	y = year;
+	min += DAYS400Y * 1440LL * (y/400);
+	y %= 400;
+	min += DAYS100Y * 1440LL * (y/100);
+	y %= 100;
+	min += DAYS4Y * 1440LL * (y/4);
+	y %= 4;
+	min += 365LL * 1440LL * y;
+	if (!is_leap_year(year) && year > 0)
+		min += 1440LL;
+	return min;
+}
+
 /* This does not apply a offset for timezone/DST. */
 bool
 dtime2min(long long *min, struct dtime *dt)
 {
 	int doy;
-	long long year;
 
 	if ((doy = dtime2doy(dt)) < 0) {
 		errset("dom/mon/year incompatible");
@@ -130,18 +213,7 @@ dtime2min(long long *min, struct dtime *dt)
 
 	/* Epoch at 1 Jan 1BC. If we scaled by 60 and offset by 62167219200LL, we
 	 * could convert to Unix time (not accounting for UTC offset). */
-	*min = 0;
-	*min += dt->min + 60LL*dt->hour + 1440LL*doy;
-	year = dt->year;
-	*min += DAYS400Y * 1440LL * (year/400);
-	year %= 400;
-	*min += DAYS100Y * 1440LL * (year/100);
-	year %= 100;
-	*min += DAYS4Y * 1440LL * (year/4);
-	year %= 4;
-	*min += 365LL * 1440LL * year;
-	if (!is_leap_year(dt->year) && dt->year > 0)
-		*min += 1440LL;
+	*min = yearmin(dt->year) + 1440LL*doy + 60LL*dt->hour + dt->min;
 
 	return true;
 }
@@ -159,12 +231,6 @@ min2dtime(struct dtime *dt, long long min)
 	enum month mon;
 	int *monthdays; /* Either monthdayscommon or monthdaysleap. */
 
-	if (min/(365LL*1440LL) > (long long) SPANV_MAX ||
-	    min/(365LL*1440LL) < (long long) SPANV_MIN) {
-		errset("min overflows dtime year");
-		return false;
-	}
-
 	days = min / 1440LL;
 	minrem = min % 1440LL;
 	if (minrem < 0) {
@@ -196,6 +262,12 @@ min2dtime(struct dtime *dt, long long min)
 	for (mon = JAN; days >= monthdays[mon]; ++mon)
 		days -= monthdays[mon];
 
+	/* Checked on the exact year, so that every minute of YEAR_MAX converts. */
+	if (!inrange(400*y400 + 100*y100 + 4*y4 + yrem,
+	             (long long) SPANV_MIN, (long long) SPANV_MAX)) {
+		errset("min overflows dtime year");
+		return false;
+	}
 	dt->year = 400*y400 + 100*y100 + 4*y4 + yrem;
 	dt->mon  = mon;
 	dt->dom  = days;
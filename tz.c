@@ -0,0 +1,547 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sres.h"
+
+/* Time zone support: the zone named by TZ is loaded once from its TZif file
+ * (see tzfile(5)) and/or POSIX TZ string, so that converting a local time to
+ * Unix time is a binary search instead of a call to mktime. */
+
+#define TZDIR_DFLT "/usr/share/zoneinfo"
+#define TZ_DFLTRULE "M3.2.0,M11.1.0"
+/* The most years of rule transitions tz_load will precompute. */
+#define TZ_MAXYEARS 1000
+
+static uint32_t
+be32(unsigned char const *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+	       (uint32_t) p[2] << 8 | p[3];
+}
+
+static int64_t
+be64(unsigned char const *p)
+{
+	return (int64_t) ((uint64_t) be32(p) << 32 | be32(p+4));
+}
+
+static bool
+readfile(char const *path, unsigned char **buf, size_t *len)
+{
+	FILE *f;
+	size_t cap, n;
+	unsigned char *p;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return false;
+	*buf = NULL;
+	*len = cap = 0;
+	do {
+		if (*len == cap) {
+			if ((p = realloc(*buf, cap = cap ? 2*cap : 4096)) == NULL)
+				break;
+			*buf = p;
+		}
+		n = fread(*buf + *len, 1, cap - *len, f);
+		*len += n;
+	} while (n > 0);
+	if (*len == cap || ferror(f)) {
+		free(*buf);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+/* Parses [+|-]hh[:mm[:ss]] into seconds. */
+static bool
+parse_tzsecs(long *secs, char const **s)
+{
+	int sign;
+	long n, i;
+
+	sign = 1;
+	if (**s == '+' || **s == '-')
+		sign = *(*s)++ == '-' ? -1 : 1;
+	*secs = 0;
+	for (i = 0; i < 3; ++i) {
+		if (!isdigit((unsigned char) **s))
+			return false;
+		for (n = 0; isdigit((unsigned char) **s); ++*s) {
+			n = 10*n + (**s - '0');
+			if (n > 167) /* hh may go up to 167 for rule times. */
+				return false;
+		}
+		*secs += n * (i == 0 ? 3600 : i == 1 ? 60 : 1);
+		if (**s != ':')
+			break;
+		++*s;
+	}
+	*secs *= sign;
+	return true;
+}
+
+static bool
+parse_tzname(char const **s)
+{
+	char const *begin;
+
+	if (**s == '<') {
+		while (**s != '>') {
+			if (**s == '\0')
+				return false;
+			++*s;
+		}
+		++*s;
+		return true;
+	}
+	for (begin = *s; isalpha((unsigned char) **s); ++*s)
+		;
+	return *s - begin >= 3;
+}
+
+static bool
+parse_tzrule(struct tzrule *r, char const **s)
+{
+	int n;
+
+	if (**s == 'M') {
+		r->type = 'M';
+		++*s;
+		if (sscanf(*s, "%d.%d.%d%n", &r->m, &r->w, &r->d, &n) != 3 ||
+		    !inrange(r->m, 1, 12) || !inrange(r->w, 1, 5) ||
+		    !inrange(r->d, 0, 6))
+			return false;
+		*s += n;
+	} else {
+		r->type = 'D';
+		if (**s == 'J') {
+			r->type = 'J';
+			++*s;
+		}
+		if (!isdigit((unsigned char) **s))
+			return false;
+		for (r->n = 0; isdigit((unsigned char) **s); ++*s) {
+			r->n = 10*r->n + (**s - '0');
+			if (r->n > 365)
+				return false;
+		}
+		if (r->type == 'J' && r->n == 0)
+			return false;
+	}
+	r->secs = 2*3600;
+	if (**s == '/') {
+		++*s;
+		return parse_tzsecs(&r->secs, s);
+	}
+	return true;
+}
+
+/* Parses a POSIX TZ string, e.g., "EST5EDT,M3.2.0,M11.1.0". */
+static bool
+parse_tzstring(struct tz *tz, char const *s)
+{
+	char const *rule;
+
+	if (!parse_tzname(&s) || !parse_tzsecs(&tz->stdoff, &s))
+		return false;
+	tz->stdoff = -tz->stdoff; /* POSIX offsets are positive west of UTC. */
+	tz->hasdst = *s != '\0';
+	if (!tz->hasdst)
+		return true;
+	if (!parse_tzname(&s))
+		return false;
+	tz->dstoff = tz->stdoff + 3600;
+	if (*s != ',' && *s != '\0') {
+		if (!parse_tzsecs(&tz->dstoff, &s))
+			return false;
+		tz->dstoff = -tz->dstoff;
+	}
+	rule = *s == ',' ? s+1 : TZ_DFLTRULE;
+	if (!parse_tzrule(&tz->start, &rule) || *rule++ != ',' ||
+	    !parse_tzrule(&tz->end, &rule) || *rule != '\0')
+		return false;
+	return *s == '\0' || *s == ',';
+}
+
+/* Parses the contents of a TZif file. */
+static bool
+parse_tzif(struct tz *tz, unsigned char const *p, size_t len)
+{
+	unsigned char const *end, *times, *idxs, *types;
+	uint32_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt;
+	size_t tsize, i;
+	char *footer;
+
+	end = p + len;
+	tsize = 4;
+	for (;;) {
+		if (end - p < 44 || memcmp(p, "TZif", 4) != 0)
+			return false;
+		isutcnt  = be32(p + 20);
+		isstdcnt = be32(p + 24);
+		leapcnt  = be32(p + 28);
+		timecnt  = be32(p + 32);
+		typecnt  = be32(p + 36);
+		charcnt  = be32(p + 40);
+		if (typecnt == 0 ||
+		    (size_t) (end - p - 44) < timecnt*(tsize+1) + typecnt*6 +
+		                              charcnt + leapcnt*(tsize+4) +
+		                              isstdcnt + isutcnt)
+			return false;
+		/* Version 2+ files repeat the data with 64-bit times, which is the
+		 * block we want. */
+		if (tsize == 8 || p[4] < '2')
+			break;
+		p += 44 + timecnt*5 + typecnt*6 + charcnt + leapcnt*8 +
+		     isstdcnt + isutcnt;
+		tsize = 8;
+	}
+
+	times = p + 44;
+	idxs = times + timecnt*tsize;
+	types = idxs + timecnt;
+	tz->off0 = (int32_t) be32(types);
+	if ((tz->trans = malloc((timecnt ? timecnt : 1) * sizeof *tz->trans)) == NULL)
+		return false;
+	tz->ntrans = timecnt;
+	for (i = 0; i < timecnt; ++i) {
+		if (idxs[i] >= typecnt)
+			return false;
+		tz->trans[i].t = tsize == 8 ? be64(times + 8*i)
+		                            : (int32_t) be32(times + 4*i);
+		tz->trans[i].off = (int32_t) be32(types + 6*idxs[i]);
+	}
+
+	/* The footer, if any, is a TZ string for times after the last
+	 * transition. */
+	p = types + typecnt*6 + charcnt + leapcnt*(tsize+4) + isstdcnt + isutcnt;
+	tz->hasrule = false;
+	if (tsize == 8 && end - p > 2 && *p == '\n' && end[-1] == '\n') {
+		if ((footer = malloc(end - p - 1)) == NULL)
+			return false;
+		memcpy(footer, p+1, end - p - 2);
+		footer[end - p - 2] = '\0';
+		tz->hasrule = *footer != '\0' && parse_tzstring(tz, footer);
+		free(footer);
+	}
+	return true;
+}
+
+/* Unix time of the local time secs seconds into the day given by a 0-based
+ * day of the year. */
+static long long
+localday2unix(Spanv year, int doy, long secs, long off)
+{
+	long long min;
+
+	min = yearmin(year) + 1440LL*doy;
+	return (min - UNIX_EPOCH_MIN) * 60 + secs - off;
+}
+
+static int
+ruledoy(struct tzrule *r, Spanv year)
+{
+	struct dtime dt;
+	int leap, doy, first;
+
+	dt.year = year;
+	dt.hour = dt.min = 0;
+	dt.mon = FEB;
+	dt.dom = 28;
+	leap = dtime_isdmyvalid(&dt); /* Is there a 29 February? */
+	switch (r->type) {
+	case 'J':
+		return r->n - 1 + (leap && r->n >= 60);
+	case 'D':
+		return r->n;
+	default:
+		dt.mon = r->m - 1;
+		dt.dom = 0;
+		doy = dtime2doy(&dt);
+		dtime_calcdow(&dt);
+		first = (r->d - dt.dow + 7) % 7;
+		dt.dom = first + 7*(r->w - 1);
+		while (!dtime_isdmyvalid(&dt))
+			dt.dom -= 7;
+		return doy + dt.dom;
+	}
+}
+
+/* Appends the rule's transitions in the given year, in order. */
+static void
+ruletrans(struct tz *tz, Spanv year, struct tztrans *out)
+{
+	struct tztrans start, end;
+
+	/* The change to DST happens in local standard time, and vice versa. */
+	start.t = localday2unix(year, ruledoy(&tz->start, year), tz->start.secs,
+	                        tz->stdoff);
+	start.off = tz->dstoff;
+	end.t = localday2unix(year, ruledoy(&tz->end, year), tz->end.secs,
+	                      tz->dstoff);
+	end.off = tz->stdoff;
+	out[0] = start.t <= end.t ? start : end;
+	out[1] = start.t <= end.t ? end : start;
+}
+
+/* Finds the UTC offset for the local time l (seconds since the Unix epoch as
+ * if local time were UTC) given transitions trans[0..len) and the offset off0
+ * before them. Returns true iff l does not exist (it was skipped over by a
+ * transition), in which case *off is the offset before the transition. For l
+ * which occurs twice, *off gives the earlier occurrence. */
+static bool
+findoff(struct tztrans *trans, size_t len, long off0, long long l, long *off)
+{
+	size_t lo, hi, mid;
+	long before, after;
+
+	/* Find the last transition whose ambiguous local range starts at or
+	 * before l. */
+	lo = 0;
+	hi = len;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		before = mid > 0 ? trans[mid-1].off : off0;
+		if (trans[mid].t + min(before, trans[mid].off) <= l)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0) {
+		*off = off0;
+		return false;
+	}
+	before = lo > 1 ? trans[lo-2].off : off0;
+	after = trans[lo-1].off;
+	if (l < trans[lo-1].t + max(before, after)) {
+		*off = before;
+		return after > before;
+	}
+	*off = after;
+	return false;
+}
+
+static bool
+tz_offset(struct tz *tz, long long min, long *off)
+{
+	long long l;
+	struct dtime dt;
+	struct tztrans trans[6];
+	int i;
+
+	l = (min - UNIX_EPOCH_MIN) * 60;
+	if (!tz->hasrule || (tz->ntrans > 0 &&
+	    l < tz->trans[tz->ntrans-1].t + tz->trans[tz->ntrans-1].off))
+		return findoff(tz->trans, tz->ntrans, tz->off0, l, off);
+	if (!tz->hasdst) {
+		*off = tz->stdoff;
+		return false;
+	}
+	/* Local times within a day of either end of the cache may belong to a
+	 * year outside of it. */
+	if (tz->ncache > 0 && l >= tz->cache[0].t + 86400 &&
+	    l < tz->cache[tz->ncache-1].t - 86400)
+		return findoff(tz->cache, tz->ncache, tz->cacheoff0, l, off);
+
+	/* Outside of the precomputed range: work out the transitions around l
+	 * on the spot. */
+	min2dtime(&dt, min);
+	for (i = 0; i < 3; ++i)
+		ruletrans(tz, dt.year - 1 + i, &trans[2*i]);
+	return findoff(trans, 6, trans[5].off, l, off);
+}
+
+bool
+tz_load(struct tz *tz, Spanv fromyear, Spanv toyear)
+{
+	char const *name, *dir;
+	char *path;
+	unsigned char *buf;
+	size_t len;
+	bool ok;
+	Spanv year;
+
+	tz->off0 = 0;
+	tz->trans = NULL;
+	tz->ntrans = 0;
+	tz->hasrule = false;
+	tz->hasdst = false;
+	tz->cache = NULL;
+	tz->ncache = 0;
+
+	if ((name = getenv("TZ")) == NULL) {
+		name = "/etc/localtime";
+	} else if (*name == ':') {
+		++name;
+	}
+	if (*name == '\0')
+		return true; /* UTC. */
+
+	/* Try a TZif file first, then a POSIX TZ string. */
+	ok = false;
+	if (*name == '/') {
+		path = NULL;
+		ok = readfile(name, &buf, &len);
+	} else if (!strstr(name, "..")) {
+		if ((dir = getenv("TZDIR")) == NULL)
+			dir = TZDIR_DFLT;
+		if ((path = malloc(strlen(dir) + strlen(name) + 2)) == NULL) {
+			errset("out of memory");
+			return false;
+		}
+		sprintf(path, "%s/%s", dir, name);
+		ok = readfile(path, &buf, &len);
+		free(path);
+	}
+	if (ok) {
+		errno = 0;
+		ok = parse_tzif(tz, buf, len);
+		free(buf);
+		if (!ok) {
+			free(tz->trans);
+			tz->trans = NULL;
+			tz->ntrans = 0;
+			errset(errno == ENOMEM ? "out of memory" : "invalid TZif file");
+			return false;
+		}
+	} else if (parse_tzstring(tz, name)) {
+		tz->hasrule = true;
+		tz->off0 = tz->stdoff;
+	} else {
+		/* Like the C library, fall back to UTC. */
+		tz->stdoff = 0;
+		tz->hasdst = false;
+		return true;
+	}
+
+	if (!tz->hasrule || !tz->hasdst)
+		return true;
+	/* Precompute the rule's transitions over the years asked for (and a year
+	 * either side, since local and UTC years differ near 1 January). */
+	if (fromyear > YEAR_MIN)
+		--fromyear;
+	if (toyear < YEAR_MAX)
+		++toyear;
+	if ((long long) toyear - fromyear >= TZ_MAXYEARS)
+		toyear = fromyear + TZ_MAXYEARS - 1;
+	tz->ncache = 2 * ((size_t) toyear - fromyear + 1);
+	if ((tz->cache = malloc(tz->ncache * sizeof *tz->cache)) == NULL) {
+		tz_free(tz);
+		errset("out of memory");
+		return false;
+	}
+	for (year = fromyear; ; ++year) {
+		ruletrans(tz, year, &tz->cache[2 * ((size_t) year - fromyear)]);
+		if (year == toyear)
+			break;
+	}
+	/* The offset before the first transition of a year is the same as after
+	 * the last transition of any year. */
+	tz->cacheoff0 = tz->cache[tz->ncache-1].off;
+	return true;
+}
+
+void
+tz_free(struct tz *tz)
+{
+	free(tz->trans);
+	free(tz->cache);
+}
+
+long long
+tz_unix(struct tz *tz, long long min)
+{
+	long off;
+
+	tz_offset(tz, min, &off);
+	return (min - UNIX_EPOCH_MIN) * 60 - off;
+}
+
+bool
+tz_isgap(struct tz *tz, long long min)
+{
+	long off;
+
+	return tz_offset(tz, min, &off);
+}
+
+/* The minutes of the local times [b, e) (in seconds, as in findoff), if
+ * there are any. */
+static bool
+gapmins(long long b, long long e, long long *gapbegin, long long *gapend)
+{
+	/* Round up, towards the first whole minute in the range. */
+	*gapbegin = UNIX_EPOCH_MIN + (b >= 0 ? (b + 59) / 60 : b / 60);
+	*gapend = UNIX_EPOCH_MIN + (e >= 0 ? (e + 59) / 60 : e / 60);
+	return *gapbegin < *gapend;
+}
+
+/* Find the first gap (see tz_isgap) which ends after min, as the minutes
+ * [*gapbegin, *gapend). Returns false if there is no such gap. */
+bool
+tz_nextgap(struct tz *tz, long long min, long long *gapbegin,
+           long long *gapend)
+{
+	long long l, lastt;
+	size_t lo, hi, mid, i;
+	long before;
+	struct dtime dt;
+	struct tztrans trans[2];
+	Spanv year;
+	int j;
+
+	/* Transitions make their gaps in order, so skip those ending by l. */
+	l = (min - UNIX_EPOCH_MIN) * 60;
+	lo = 0;
+	hi = tz->ntrans;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		before = mid > 0 ? tz->trans[mid-1].off : tz->off0;
+		if (tz->trans[mid].t + max(before, tz->trans[mid].off) <= l)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = lo; i < tz->ntrans; ++i) {
+		before = i > 0 ? tz->trans[i-1].off : tz->off0;
+		if (tz->trans[i].off > before &&
+		    gapmins(tz->trans[i].t + before, tz->trans[i].t + tz->trans[i].off,
+		            gapbegin, gapend) && *gapend > min)
+			return true;
+	}
+	if (!tz->hasrule || !tz->hasdst)
+		return false;
+
+	/* The rule takes over after the last transition, and makes a gap every
+	 * year, so the one wanted is in the year of l or the next. */
+	lastt = LLONG_MIN;
+	if (tz->ntrans > 0) {
+		lastt = tz->trans[tz->ntrans-1].t;
+		l = max(l, lastt + tz->trans[tz->ntrans-1].off);
+	}
+	if (!min2dtime(&dt, UNIX_EPOCH_MIN + l/60))
+		return false;
+	for (year = dt.year > YEAR_MIN ? dt.year-1 : dt.year; ; ++year) {
+		ruletrans(tz, year, trans);
+		for (j = 0; j < 2; ++j) {
+			/* The transition before either of a year's two is the other. */
+			before = trans[1-j].off;
+			if (trans[j].off > before && trans[j].t > lastt &&
+			    gapmins(trans[j].t + before, trans[j].t + trans[j].off,
+			            gapbegin, gapend) && *gapend > min)
+				return true;
+		}
+		if (year > dt.year || year == YEAR_MAX)
+			return false;
+	}
+}
@@ -1,39 +1,227 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "sres.h"
 
 #define ERRLEN_MAX 4096
-static char err[ERRLEN_MAX+1];
-static int errlen;
+/* Per thread, so that inputs can be parsed in parallel. */
+static _Thread_local char err[ERRLEN_MAX+1];
+static _Thread_local int errlen;
 
-void *
-malloc_or_exit(size_t n)
+static bool
+input_read(struct input *in, int fd)
+{
+	char *buf, *p;
+	size_t cap;
+	ssize_t r;
+
+	buf = NULL;
+	cap = 0;
+	in->len = 0;
+	for (;;) {
+		if (in->len == cap) {
+			if (cap > SIZE_MAX / 2) {
+				errset("input too big");
+				goto err;
+			}
+			cap = cap > 0 ? 2*cap : 1 << 16;
+			if ((p = realloc(buf, cap)) == NULL) {
+				errset("out of memory");
+				goto err;
+			}
+			buf = p;
+		}
+		if ((r = read(fd, buf + in->len, cap - in->len)) == 0)
+			break;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			errset(strerror(errno));
+			goto err;
+		}
+		in->len += r;
+	}
+	in->buf = buf;
+	return true;
+
+err:
+	free(buf);
+	return false;
+}
+
+static void
+stamp_fill(struct inputstamp *st, struct stat *sb)
+{
+	memset(st, 0, sizeof *st);
+	if (!S_ISREG(sb->st_mode))
+		return;
+	st->dev = sb->st_dev;
+	st->ino = sb->st_ino;
+	st->size = sb->st_size;
+	st->mtime = sb->st_mtim.tv_sec;
+	st->mtimensec = sb->st_mtim.tv_nsec;
+	st->valid = 1;
+}
+
+/* Stamp the file at path as it is now (see struct inputstamp). */
+bool
+input_stamp(struct inputstamp *st, char const *path)
+{
+	struct stat sb;
+
+	memset(st, 0, sizeof *st);
+	if (path == NULL || !strcmp(path, "-"))
+		return true;
+	if (stat(path, &sb) < 0) {
+		errset(strerror(errno));
+		erradd(path);
+		return false;
+	}
+	stamp_fill(st, &sb);
+	return true;
+}
+
+/* Load the file at path ("-" or NULL => standard input). Regular files are
+ * mapped rather than read, so loading them costs no copying. */
+bool
+input_open(struct input *in, char const *path)
 {
-	void *ptr;
+	int fd;
+	struct stat st;
+	void *p;
+	bool ok;
+
+	in->name = NULL;
+	in->buf = NULL;
+	in->len = 0;
+	in->mapped = false;
+	memset(&in->stamp, 0, sizeof in->stamp);
+	if (path == NULL || !strcmp(path, "-"))
+		return input_read(in, STDIN_FILENO);
 
-	if ((ptr = malloc(n)) == NULL)
-		errexit("out of memory");
-	return ptr;
+	in->name = path;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		errset(strerror(errno));
+		erradd(path);
+		return false;
+	}
+	if (fstat(fd, &st) < 0) {
+		errset(strerror(errno));
+		ok = false;
+	} else if (!S_ISREG(st.st_mode)) {
+		ok = input_read(in, fd);
+	} else if (st.st_size == 0) {
+		ok = true; /* Can't map an empty file. */
+	} else if ((uintmax_t)st.st_size > SIZE_MAX) {
+		errset("input too big");
+		ok = false;
+	} else if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	           == MAP_FAILED) {
+		errset(strerror(errno));
+		ok = false;
+	} else {
+		posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+		in->buf = p;
+		in->len = st.st_size;
+		in->mapped = true;
+		ok = true;
+	}
+	close(fd);
+	if (ok)
+		stamp_fill(&in->stamp, &st);
+	else
+		erradd(path);
+	return ok;
 }
 
+void
+input_close(struct input *in)
+{
+	if (in->mapped)
+		munmap((void *)in->buf, in->len);
+	else
+		free((void *)in->buf);
+	in->buf = NULL;
+	in->len = 0;
+}
+
+void
+arena_init(struct arena *a)
+{
+	a->blocks = NULL;
+	a->p = a->end = NULL;
+}
+
+/* Returns NULL (with an error set) if out of memory. */
 void *
-realloc_or_exit(void *ptr, size_t n)
+arena_alloc(struct arena *a, size_t n)
 {
-	if ((ptr = realloc(ptr, n)) == NULL)
-		errexit("out of memory");
-	return ptr;
+	struct arenablock *b;
+	size_t size;
+	void *p;
+
+	if (n > SIZE_MAX - sizeof(long long) - sizeof *b - ARENA_BLOCK) {
+		errset("out of memory");
+		return NULL;
+	}
+	n = (n + sizeof(long long)-1) / sizeof(long long) * sizeof(long long);
+	if (n > (size_t)(a->end - a->p)) {
+		size = max(n, ARENA_BLOCK);
+		if ((b = malloc(sizeof *b + size)) == NULL) {
+			errset("out of memory");
+			return NULL;
+		}
+		b->next = a->blocks;
+		a->blocks = b;
+		a->p = (char *)b->data;
+		a->end = a->p + size;
+	}
+	p = a->p;
+	a->p += n;
+	return p;
 }
 
+/* Move src's blocks into dst, leaving src empty. */
 void
-errexit(char const *msg)
+arena_splice(struct arena *dst, struct arena *src)
 {
-	fprintf(stderr, "error: %s\n", msg);
-	exit(EXIT_FAILURE);
+	struct arenablock *b;
+
+	if (src->blocks == NULL)
+		return;
+	if (dst->blocks == NULL) {
+		*dst = *src;
+	} else {
+		/* dst keeps allocating from its own first block. */
+		for (b = src->blocks; b->next; b = b->next)
+			;
+		b->next = dst->blocks->next;
+		dst->blocks->next = src->blocks;
+	}
+	arena_init(src);
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arenablock *b, *next;
+
+	for (b = a->blocks; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	arena_init(a);
 }
 
 void